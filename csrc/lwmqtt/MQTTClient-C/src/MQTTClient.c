@@ -21,26 +21,899 @@
 #include <stdio.h>
 #include <string.h>
 
+/* The network is read by one task at a time, holding c->mutex, while packets can be sent by any task
+ * holding c->write_mutex: publishers don't wait for a reader parked in select. The write lock also
+ * protects the in-flight table and the handlers, and is always taken after c->mutex, never before. */
+#if defined(MQTT_TASK)
+#define lockWrite(c)    MutexLock(&(c)->write_mutex)
+#define unlockWrite(c)  MutexUnlock(&(c)->write_mutex)
+#else
+#define lockWrite(c)
+#define unlockWrite(c)
+#endif
+
 
 static void NewMessageData(MessageData* md, MQTTString* aTopicName, MQTTMessage* aMessage) {
     md->topicName = aTopicName;
     md->message = aMessage;
+    md->subscriptions = NULL;
+    md->subscription_count = 0;
 }
 
 
-static int getNextPacketId(MQTTClient *c) {
-    return c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+static int isPublishState(unsigned char state)
+{
+    return state == INFLIGHT_WAIT_PUBACK || state == INFLIGHT_WAIT_PUBREC || state == INFLIGHT_WAIT_PUBCOMP;
 }
 
 
-static int sendPacket(MQTTClient* c, int length, Timer* timer)
+static int findInflight(MQTTClient* c, unsigned short packetid)
+{
+    int i;
+
+    for (i = 0; i < INFLIGHT_SLOTS; ++i)
+    {
+        if (c->inflight[i].state != INFLIGHT_FREE && c->inflight[i].state != INFLIGHT_DONE &&
+            c->inflight[i].id == packetid)
+            return i;
+    }
+    return -1;
+}
+
+
+/* Called with the write lock held. The in-flight table holds every exchange waiting for its ack,
+ * kept ones included: their ids stay in use until the slot is released, and are skipped here. */
+static int getNextPacketId(MQTTClient *c)
+{
+    do
+        c->next_packetid = (c->next_packetid == MAX_PACKET_ID) ? 1 : c->next_packetid + 1;
+    while (findInflight(c, c->next_packetid) >= 0);
+    return c->next_packetid;
+}
+
+
+/* publishes are limited by the in-flight window, subscriptions can use any free slot */
+static int findFreeInflight(MQTTClient* c, int windowed)
+{
+    int i;
+    unsigned int used = 0;
+
+    for (i = 0; i < INFLIGHT_SLOTS; ++i)
+    {
+        if (isPublishState(c->inflight[i].state))
+            used++;
+    }
+    if (windowed && used >= c->inflight_window)
+        return -1;
+    for (i = 0; i < INFLIGHT_SLOTS; ++i)
+    {
+        if (c->inflight[i].state == INFLIGHT_FREE)
+            return i;
+    }
+    return -1;
+}
+
+
+static void appendQueued(MQTTClient* c, MQTTQueuedMessage* q)
+{
+    q->next = NULL;
+    if (c->queue_tail != NULL)
+        c->queue_tail->next = q;
+    else
+        c->queue_head = q;
+    c->queue_tail = q;
+    c->queue_bytes += q->size;
+    c->queue_count++;
+}
+
+
+/* Queued messages are kept in publishing order: messages queued again after a failed exchange go back
+ * before the newer persisted ones, which follow the log order. */
+static void insertQueued(MQTTClient* c, MQTTQueuedMessage* q)
+{
+    MQTTQueuedMessage** p = &c->queue_head;
+
+    while (*p != NULL && (*p)->record.seq != 0 && (*p)->record.seq < q->record.seq)
+        p = &(*p)->next;
+    q->next = *p;
+    *p = q;
+    if (q->next == NULL)
+        c->queue_tail = q;
+    c->queue_bytes += q->size;
+    c->queue_count++;
+}
+
+
+static void removeQueued(MQTTClient* c, MQTTQueuedMessage* q)
+{
+    MQTTQueuedMessage** p = &c->queue_head;
+    MQTTQueuedMessage* prev = NULL;
+
+    while (*p != q)
+    {
+        prev = *p;
+        p = &(*p)->next;
+    }
+    *p = q->next;
+    if (c->queue_tail == q)
+        c->queue_tail = prev;
+    c->queue_bytes -= q->size;
+    c->queue_count--;
+    MQTTFree(q);
+}
+
+
+/* The persistence log is a sequence of records: type, 4 bytes body length, body, 4 bytes checksum.
+ * A log starts with LOG_BEGIN and its generation, and is valid once LOG_COMMIT follows the records
+ * copied by the compaction that created it. LOG_PUBLISH keeps a message until the LOG_DONE with its
+ * sequence number. Reading stops at the first record that is torn or corrupted. */
+enum logRecordType { LOG_BEGIN = 1, LOG_COMMIT, LOG_PUBLISH, LOG_DONE };
+
+#define LOG_HEADER 5
+#define LOG_TRAILER 4
+#define LOG_PUBLISH_FIXED 8                     /* seq, qos, retained, topic length */
+
+
+static unsigned int logChecksum(unsigned int hash, const unsigned char* data, size_t len)
+{
+    while (len-- > 0)
+        hash = (hash ^ *data++) * 16777619u; /* FNV-1a */
+    return hash;
+}
+
+
+static void writeLogInt(unsigned char* p, unsigned int value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+
+static unsigned int readLogInt(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+
+static int writeLog(MQTTClient* c)
+{
+    int rc = SUCCESS;
+
+    if (c->log_buffered > 0)
+        rc = c->persistence->append(c->persistence->context, c->log_index, c->log_buf, c->log_buffered);
+    c->log_buffered = 0;
+    return rc;
+}
+
+
+static int flushLog(MQTTClient* c)
+{
+    int rc = writeLog(c);
+
+    if (rc == SUCCESS)
+        rc = c->persistence->sync(c->persistence->context, c->log_index);
+    return rc;
+}
+
+
+static int appendLog(MQTTClient* c, const void* data, size_t len)
+{
+    int rc = SUCCESS;
+
+    if (c->log_buffered + len > PERSISTENCE_BUFFER)
+        rc = writeLog(c);
+    if (rc == SUCCESS && len >= PERSISTENCE_BUFFER)
+        rc = c->persistence->append(c->persistence->context, c->log_index, data, len);
+    else if (rc == SUCCESS && len > 0)
+    {
+        memcpy(&c->log_buf[c->log_buffered], data, len);
+        c->log_buffered += len;
+    }
+    c->log_size += len;
+    return rc;
+}
+
+
+/* Append a record whose body is a fixed part followed by two byte strings, setting its place in *record */
+static int logRecord(MQTTClient* c, unsigned char type, const unsigned char* fixed, size_t fixed_len,
+    const void* data1, size_t len1, const void* data2, size_t len2, MQTTLogRecord* record)
+{
+    unsigned char header[LOG_HEADER], trailer[LOG_TRAILER];
+    unsigned int hash;
+    int rc;
+
+    header[0] = type;
+    writeLogInt(&header[1], fixed_len + len1 + len2);
+    hash = logChecksum(2166136261u, header, LOG_HEADER);
+    hash = logChecksum(hash, fixed, fixed_len);
+    hash = logChecksum(hash, data1, len1);
+    hash = logChecksum(hash, data2, len2);
+    writeLogInt(trailer, hash);
+    if (record != NULL)
+    {
+        record->offset = c->log_size;
+        record->len = LOG_HEADER + fixed_len + len1 + len2 + LOG_TRAILER;
+    }
+    if ((rc = appendLog(c, header, LOG_HEADER)) == SUCCESS &&
+        (rc = appendLog(c, fixed, fixed_len)) == SUCCESS &&
+        (rc = appendLog(c, data1, len1)) == SUCCESS &&
+        (rc = appendLog(c, data2, len2)) == SUCCESS)
+        rc = appendLog(c, trailer, LOG_TRAILER);
+    return rc;
+}
+
+
+static int readLog(MQTTClient* c, int log, size_t offset, unsigned char* data, size_t len)
+{
+    while (len > 0)
+    {
+        int rc = c->persistence->read(c->persistence->context, log, offset, data, len);
+
+        if (rc <= 0)
+            return FAILURE;
+        offset += rc;
+        data += rc;
+        len -= rc;
+    }
+    return SUCCESS;
+}
+
+
+/* Check the record at offset, returning its length or 0 if there is no valid record there.
+ * The body is read in body when it fits in max bytes, otherwise it is only checked. */
+static size_t readLogRecord(MQTTClient* c, int log, size_t offset, unsigned char* type, size_t* body_len,
+    unsigned char* body, size_t max)
+{
+    unsigned char header[LOG_HEADER], trailer[LOG_TRAILER], chunk[32];
+    unsigned int hash;
+    size_t len, done;
+
+    if (readLog(c, log, offset, header, LOG_HEADER) != SUCCESS || header[0] < LOG_BEGIN || header[0] > LOG_DONE)
+        return 0;
+    len = readLogInt(&header[1]);
+    hash = logChecksum(2166136261u, header, LOG_HEADER);
+    offset += LOG_HEADER;
+    if (body != NULL && len <= max)
+    {
+        if (readLog(c, log, offset, body, len) != SUCCESS)
+            return 0;
+        hash = logChecksum(hash, body, len);
+    }
+    else
+    {
+        for (done = 0; done < len; done += sizeof(chunk))
+        {
+            size_t n = (len - done < sizeof(chunk)) ? len - done : sizeof(chunk);
+
+            if (readLog(c, log, offset + done, chunk, n) != SUCCESS)
+                return 0;
+            hash = logChecksum(hash, chunk, n);
+        }
+    }
+    if (readLog(c, log, offset + len, trailer, LOG_TRAILER) != SUCCESS || readLogInt(trailer) != hash)
+        return 0;
+    *type = header[0];
+    *body_len = len;
+    return LOG_HEADER + len + LOG_TRAILER;
+}
+
+
+/* Read the LOG_PUBLISH record at offset into a new queue entry */
+static MQTTQueuedMessage* loadLogRecord(MQTTClient* c, int log, size_t offset)
+{
+    MQTTQueuedMessage* q;
+    unsigned char type, *body;
+    size_t len, topic_len, record_len;
+
+    if ((record_len = readLogRecord(c, log, offset, &type, &len, NULL, 0)) == 0 || type != LOG_PUBLISH ||
+        len < LOG_PUBLISH_FIXED || (q = MQTTMalloc(sizeof(MQTTQueuedMessage) + len)) == NULL)
+        return NULL;
+    body = (unsigned char*)(q + 1);
+    readLogRecord(c, log, offset, &type, &len, body, len);
+    topic_len = (body[6] << 8) | body[7];
+    if (topic_len == 0 || LOG_PUBLISH_FIXED + topic_len > len)
+    {
+        MQTTFree(q);
+        return NULL;
+    }
+    q->size = sizeof(MQTTQueuedMessage) + len;
+    q->topicName = (char*)&body[LOG_PUBLISH_FIXED];
+    q->topicName[topic_len - 1] = '\0';
+    q->message.qos = (enum QoS)body[4];
+    q->message.retained = body[5];
+    q->message.dup = 0;
+    q->message.id = 0;
+    q->message.payload = &body[LOG_PUBLISH_FIXED + topic_len];
+    q->message.payloadlen = len - LOG_PUBLISH_FIXED - topic_len;
+    q->record.seq = readLogInt(body);
+    q->record.offset = offset;
+    q->record.len = record_len;
+    return q;
+}
+
+
+/* Copy a record from the other log to the current one, through the second half of c->log_buf:
+ * c->buf may hold a packet being sent */
+static int copyLogRecord(MQTTClient* c, int from, MQTTLogRecord* record)
+{
+    unsigned char* copy = c->log_buf + PERSISTENCE_BUFFER;
+    size_t done, n;
+    int rc = SUCCESS;
+
+    for (done = 0; done < record->len && rc == SUCCESS; done += n)
+    {
+        n = (record->len - done < PERSISTENCE_BUFFER) ? record->len - done : PERSISTENCE_BUFFER;
+        if ((rc = readLog(c, from, record->offset + done, copy, n)) == SUCCESS)
+            rc = appendLog(c, copy, n);
+    }
+    return rc;
+}
+
+
+/* Start a new log in the other slot with the records of the messages not acked yet.
+ * Until it is committed the current log stays valid, and is kept on failure. */
+static int compactLog(MQTTClient* c)
+{
+    int from = c->log_index, i, rc;
+    size_t size = c->log_size, offset;
+    unsigned char generation[4];
+    MQTTQueuedMessage* q;
+
+    if ((rc = flushLog(c)) != SUCCESS ||
+        (rc = c->persistence->erase(c->persistence->context, !from)) != SUCCESS)
+        return rc;
+    c->log_index = !from;
+    c->log_size = 0;
+    writeLogInt(generation, c->log_generation + 1);
+    rc = logRecord(c, LOG_BEGIN, generation, sizeof(generation), NULL, 0, NULL, 0, NULL);
+    offset = c->log_size;
+    for (i = 0; i < INFLIGHT_SLOTS && rc == SUCCESS; ++i)
+    {
+        if (isPublishState(c->inflight[i].state) && c->inflight[i].record.seq != 0)
+            rc = copyLogRecord(c, from, &c->inflight[i].record);
+    }
+    for (q = c->queue_head; q != NULL && rc == SUCCESS; q = q->next)
+    {
+        if (q->record.seq != 0)
+            rc = copyLogRecord(c, from, &q->record);
+    }
+    if (rc == SUCCESS && (rc = logRecord(c, LOG_COMMIT, NULL, 0, NULL, 0, NULL, 0, NULL)) == SUCCESS)
+        rc = flushLog(c);
+    if (rc != SUCCESS)
+    {
+        c->log_index = from;
+        c->log_size = size;
+        c->log_buffered = 0;
+        return rc;
+    }
+
+    /* the records were copied in the same order */
+    for (i = 0; i < INFLIGHT_SLOTS; ++i)
+    {
+        if (isPublishState(c->inflight[i].state) && c->inflight[i].record.seq != 0)
+        {
+            c->inflight[i].record.offset = offset;
+            offset += c->inflight[i].record.len;
+        }
+    }
+    for (q = c->queue_head; q != NULL; q = q->next)
+    {
+        if (q->record.seq != 0)
+        {
+            q->record.offset = offset;
+            offset += q->record.len;
+        }
+    }
+    c->log_generation++;
+    c->persistence->erase(c->persistence->context, from);
+    return SUCCESS;
+}
+
+
+static int logPublish(MQTTClient* c, MQTTString* topic, MQTTMessage* message, MQTTLogRecord* record)
+{
+    unsigned char fixed[LOG_PUBLISH_FIXED];
+    size_t topic_len = topic->lenstring.len + 1;
+    unsigned int seq = (c->log_seq + 1 == 0) ? 1 : c->log_seq + 1;
+    int rc;
+
+    writeLogInt(fixed, seq);
+    fixed[4] = message->qos;
+    fixed[5] = message->retained;
+    fixed[6] = topic_len >> 8;
+    fixed[7] = topic_len;
+    rc = logRecord(c, LOG_PUBLISH, fixed, sizeof(fixed), topic->lenstring.data, topic_len, message->payload, message->payloadlen, record);
+    if (rc == SUCCESS)
+    {
+        c->log_seq = record->seq = seq;
+        c->log_live += record->len;
+    }
+    return rc;
+}
+
+
+/* the message has been acked or discarded: its record is not needed anymore.
+ * The log is compacted later, when the client is idle, not in the middle of an exchange. */
+static void logDone(MQTTClient* c, MQTTLogRecord* record)
+{
+    unsigned char seq[4];
+
+    if (record->seq == 0)
+        return;
+    writeLogInt(seq, record->seq);
+    logRecord(c, LOG_DONE, seq, sizeof(seq), NULL, 0, NULL, 0, NULL);
+    c->log_live -= record->len;
+    record->seq = 0;
+}
+
+
+static int logNeedsCompaction(MQTTClient* c)
+{
+    return c->log_size > PERSISTENCE_COMPACT_SIZE && c->log_live * 2 < c->log_size;
+}
+
+
+/* the exchange of a persisted publish failed: queue it again to be sent on the next connection */
+static int requeueLogged(MQTTClient* c, MQTTLogRecord* record)
+{
+    MQTTQueuedMessage* q;
+    int rc = FAILURE;
+
+    if (writeLog(c) == SUCCESS && (q = loadLogRecord(c, c->log_index, record->offset)) != NULL)
+    {
+        insertQueued(c, q);
+        rc = SUCCESS;
+    }
+    else
+        logDone(c, record);
+    record->seq = 0;
+    return rc;
+}
+
+
+/* A failed publish queued again from the log completes with REQUEUED rather than FAILURE: it is sent again,
+ * and reported, under a new packet id. Returns the outcome reported. */
+static int completeInflight(MQTTClient* c, int i, int rc)
+{
+    unsigned short packetid = c->inflight[i].id;
+    int published = isPublishState(c->inflight[i].state);
+
+    if (published && rc == SUCCESS)
+        logDone(c, &c->inflight[i].record);
+    else if (published && c->inflight[i].record.seq != 0 && requeueLogged(c, &c->inflight[i].record) == SUCCESS)
+        rc = REQUEUED;
+    if (c->inflight[i].resend != NULL)
+    {
+        MQTTFree(c->inflight[i].resend);
+        c->inflight[i].resend = NULL;
+    }
+    if (c->inflight[i].waiting)
+    {
+        c->inflight[i].state = INFLIGHT_DONE; /* the waiting task collects rc and releases the slot */
+        c->inflight[i].rc = rc;
+    }
+    else
+        c->inflight[i].state = INFLIGHT_FREE;
+    if (published && c->publishCompleteHandler != NULL)
+        c->publishCompleteHandler(packetid, rc);
+    return rc;
+}
+
+
+static void notifyWaiters(MQTTClient* c)
+{
+#if defined(MQTT_TASK)
+    while (c->ack_waiters > 0)
+    {
+        SemaphorePost(&c->ack_sem);
+        c->ack_waiters--;
+    }
+#endif
+}
+
+
+#if defined(MQTT_TASK)
+void MQTTReleaseReader(MQTTClient* c)
+{
+    MutexUnlock(&c->mutex);
+    /* a waiter failed to take the reading side while we held it: it is counted before we get the write lock */
+    lockWrite(c);
+    notifyWaiters(c);
+    unlockWrite(c);
+}
+#endif
+
+
+static void poolInit(MQTTPool* pool, void* items, size_t item_size, unsigned int count, unsigned int slab_items)
+{
+    unsigned int i;
+
+    pool->free = NULL;
+    pool->slabs = NULL;
+    pool->item_size = item_size;
+    pool->slab_items = slab_items;
+    for (i = count; i > 0; --i)
+    {
+        *(void**)((unsigned char*)items + (i - 1) * item_size) = pool->free;
+        pool->free = (unsigned char*)items + (i - 1) * item_size;
+    }
+}
+
+
+/* allocated slabs start with the link to the previous one and the number of their items in use */
+typedef struct MQTTSlab
+{
+    struct MQTTSlab* next;
+    unsigned int used;
+} MQTTSlab;
+
+#define slabItems(slab) ((unsigned char*)(slab) + sizeof(MQTTSlab))
+
+
+/* the allocated slab holding item, NULL for the first slab */
+static MQTTSlab* poolSlab(MQTTPool* pool, void* item)
+{
+    MQTTSlab* slab;
+
+    for (slab = pool->slabs; slab != NULL; slab = slab->next)
+    {
+        if ((unsigned char*)item >= slabItems(slab) &&
+            (unsigned char*)item < slabItems(slab) + pool->slab_items * pool->item_size)
+            break;
+    }
+    return slab;
+}
+
+
+static void* poolAlloc(MQTTPool* pool)
+{
+    MQTTSlab* slab;
+    void* item;
+
+    if (pool->free == NULL)
+    {
+        unsigned int i;
+
+        if ((slab = MQTTMalloc(sizeof(MQTTSlab) + pool->slab_items * pool->item_size)) == NULL)
+            return NULL;
+        slab->next = pool->slabs;
+        slab->used = 0;
+        pool->slabs = slab;
+        for (i = 0; i < pool->slab_items; ++i)
+        {
+            *(void**)(slabItems(slab) + i * pool->item_size) = pool->free;
+            pool->free = slabItems(slab) + i * pool->item_size;
+        }
+    }
+    item = pool->free;
+    pool->free = *(void**)item;
+    if ((slab = poolSlab(pool, item)) != NULL)
+        slab->used++;
+    return item;
+}
+
+
+static void poolFree(MQTTPool* pool, void* item)
+{
+    MQTTSlab *slab, **link;
+    void** free_link;
+
+    *(void**)item = pool->free;
+    pool->free = item;
+    if ((slab = poolSlab(pool, item)) == NULL || --slab->used > 0)
+        return;
+    /* the slab is unused: take its items off the free list and give it back */
+    for (free_link = &pool->free; *free_link != NULL; )
+    {
+        unsigned char* free_item = *free_link;
+
+        if (free_item >= slabItems(slab) && free_item < slabItems(slab) + pool->slab_items * pool->item_size)
+            *free_link = *(void**)free_item;
+        else
+            free_link = (void**)free_item;
+    }
+    for (link = (MQTTSlab**)&pool->slabs; *link != slab; link = &(*link)->next)
+        ;
+    *link = slab->next;
+    MQTTFree(slab);
+}
+
+
+/* Topic filters are kept in a trie with one node per level, '+' and '#' being levels like the others.
+ * Nodes are found in a hash table by parent and level hash, then compared by level text, so both
+ * subscribing and matching cost one lookup per level, however many filters share a level.
+ * Handlers are still checked against their own filter, for the '$' and "a/#" matching "a" rules. */
+static unsigned int topicLevelKey(const char* level, size_t len)
+{
+    unsigned int key = 2166136261u; /* FNV-1a */
+
+    while (len-- > 0)
+        key = (key ^ (unsigned char)*level++) * 16777619u;
+    return key;
+}
+
+
+static unsigned int topicBucket(MQTTClient* c, struct TopicNodes* parent, unsigned int key)
+{
+    return (key ^ (unsigned int)((size_t)parent >> 2)) % c->topic_buckets_size;
+}
+
+
+static struct TopicNodes* findTopicNode(MQTTClient* c, struct TopicNodes* parent, const char* level, size_t len)
+{
+    unsigned int key = topicLevelKey(level, len);
+    struct TopicNodes* node;
+
+    for (node = c->topicBuckets[topicBucket(c, parent, key)]; node != NULL; node = node->next)
+    {
+        if (node->parent == parent && node->key == key && node->level_len == len && memcmp(node->level, level, len) == 0)
+            break;
+    }
+    return node;
+}
+
+
+static void freeTopicNode(MQTTClient* c, struct TopicNodes* node)
+{
+    MQTTFree(node->level);
+    poolFree(&c->topicNodesPool, node);
+}
+
+
+/* double the hash table once it holds twice as many nodes as buckets, if memory allows */
+static void growTopicBuckets(MQTTClient* c)
+{
+    struct TopicNodes **old = c->topicBuckets, **buckets, *node;
+    unsigned int old_size = c->topic_buckets_size, i;
+
+    if ((buckets = MQTTMalloc(2 * old_size * sizeof(struct TopicNodes*))) == NULL)
+        return;
+    memset(buckets, 0, 2 * old_size * sizeof(struct TopicNodes*));
+    c->topicBuckets = buckets;
+    c->topic_buckets_size = 2 * old_size;
+    for (i = 0; i < old_size; ++i)
+    {
+        while ((node = old[i]) != NULL)
+        {
+            unsigned int b = topicBucket(c, node->parent, node->key);
+
+            old[i] = node->next;
+            node->next = buckets[b];
+            buckets[b] = node;
+        }
+    }
+    if (old != c->topicBucketsInit)
+        MQTTFree(old);
+}
+
+
+/* drop a reference to node and its ancestors, freeing the ones no filter goes through anymore */
+static void releaseTopicNodes(MQTTClient* c, struct TopicNodes* node)
+{
+    while (node != NULL)
+    {
+        struct TopicNodes* parent = node->parent;
+
+        if (--node->refs == 0)
+        {
+            struct TopicNodes** link = &c->topicBuckets[topicBucket(c, parent, node->key)];
+
+            while (*link != node)
+                link = &(*link)->next;
+            *link = node->next;
+            freeTopicNode(c, node);
+            c->topic_nodes_count--;
+        }
+        node = parent;
+    }
+}
+
+
+/* Walk the levels of topicFilter, creating the missing nodes when create is set.
+ * Returns the node of the last level, NULL if it doesn't exist or there is no memory for it. */
+static struct TopicNodes* topicFilterNode(MQTTClient* c, const char* topicFilter, int create)
+{
+    struct TopicNodes *parent = NULL, *node;
+    const char* level_end;
+
+    for (;;)
+    {
+        size_t len;
+        unsigned int key;
+
+        if ((level_end = strchr(topicFilter, '/')) == NULL)
+            level_end = topicFilter + strlen(topicFilter);
+        len = level_end - topicFilter;
+        if ((node = findTopicNode(c, parent, topicFilter, len)) == NULL)
+        {
+            if (!create || (node = poolAlloc(&c->topicNodesPool)) == NULL ||
+                (node->level = MQTTMalloc(len + 1)) == NULL)
+            {
+                if (node != NULL)
+                    poolFree(&c->topicNodesPool, node);
+                if (create)
+                    releaseTopicNodes(c, parent);
+                return NULL;
+            }
+            memcpy(node->level, topicFilter, len);
+            node->level[len] = '\0';
+            node->level_len = len;
+            key = topicLevelKey(topicFilter, len);
+            node->parent = parent;
+            node->key = key;
+            node->refs = 0;
+            node->handlers = NULL;
+            node->next = c->topicBuckets[topicBucket(c, parent, key)];
+            c->topicBuckets[topicBucket(c, parent, key)] = node;
+            if (++c->topic_nodes_count > 2 * c->topic_buckets_size)
+                growTopicBuckets(c);
+        }
+        if (create)
+            node->refs++;
+        if (*level_end == '\0')
+            return node;
+        topicFilter = level_end + 1;
+        parent = node;
+    }
+}
+
+
+// assume topic filter and name is in correct format
+// # can only be at end
+// + and # can only be next to separator
+static char isTopicMatched(const char* topicFilter, MQTTString* topicName)
+{
+    const char* curf = topicFilter;
+    const char* curn = topicName->lenstring.data;
+    const char* curn_end = curn + topicName->lenstring.len;
+
+    if (curn < curn_end && *curn == '$' && (*curf == '+' || *curf == '#'))
+        return 0; /* wildcards don't match the first level of $SYS like topics */
+    for (;;)
+    {
+        if (*curf == '#')
+            return 1;
+        if (*curf == '+')
+        {   // skip the whole level
+            curf++;
+            while (curn < curn_end && *curn != '/')
+                curn++;
+        }
+        else
+        {
+            while (*curf != '\0' && *curf != '/' && curn < curn_end && *curn == *curf)
+            {
+                curf++;
+                curn++;
+            }
+            if ((*curf != '\0' && *curf != '/') || (curn < curn_end && *curn != '/'))
+                return 0;
+        }
+        if (curn == curn_end)
+            return *curf == '\0' || (curf[0] == '/' && curf[1] == '#' && curf[2] == '\0'); /* "a/#" matches "a" */
+        if (*curf == '\0')
+            return 0;
+        curf++; /* both on a separator */
+        curn++;
+    }
+}
+
+
+/* Matches are counted in n, and copied out as long as they fit in max: handlers may go away once the write
+ * lock is released */
+static int collectHandlers(struct TopicNodes* node, MQTTString* topicName, messageHandler* fps, int* ids, int n, int max)
+{
+    struct MessageHandlers* h;
+
+    for (h = node->handlers; h != NULL; h = h->next)
+    {
+        if (!isTopicMatched(h->topicFilter, topicName))
+            continue;
+        if (n < max)
+        {
+            fps[n] = h->fp;
+            ids[n] = h->id;
+        }
+        n++;
+    }
+    return n;
+}
+
+
+static int matchTopicLevel(MQTTClient* c, struct TopicNodes* node, const char* level_end, const char* curn_end,
+    MQTTString* topicName, messageHandler* fps, int* ids, int n, int max);
+
+
+/* Collect the handlers of the filters below parent matching the topic levels in [curn, curn_end):
+ * one walk of the topic, only branching where '+' and '#' nodes sit next to the literal ones. */
+static int matchTopicNodes(MQTTClient* c, struct TopicNodes* parent, const char* curn, const char* curn_end,
+    MQTTString* topicName, messageHandler* fps, int* ids, int n, int max)
+{
+    const char* level_end = memchr(curn, '/', curn_end - curn);
+    struct TopicNodes* node;
+
+    if (level_end == NULL)
+        level_end = curn_end;
+    /* a topic level is never a wildcard itself, it would match the filter level twice */
+    if (!(level_end - curn == 1 && (*curn == '+' || *curn == '#')))
+    {
+        if ((node = findTopicNode(c, parent, curn, level_end - curn)) != NULL)
+            n = matchTopicLevel(c, node, level_end, curn_end, topicName, fps, ids, n, max);
+    }
+    if ((node = findTopicNode(c, parent, "+", 1)) != NULL)
+        n = matchTopicLevel(c, node, level_end, curn_end, topicName, fps, ids, n, max);
+    if ((node = findTopicNode(c, parent, "#", 1)) != NULL)
+        n = collectHandlers(node, topicName, fps, ids, n, max);
+    return n;
+}
+
+
+/* node matches the topic level ending at level_end: go on with the next one, or collect the filters ending here */
+static int matchTopicLevel(MQTTClient* c, struct TopicNodes* node, const char* level_end, const char* curn_end,
+    MQTTString* topicName, messageHandler* fps, int* ids, int n, int max)
+{
+    struct TopicNodes* hash_node;
+
+    if (level_end < curn_end)
+        return matchTopicNodes(c, node, level_end + 1, curn_end, topicName, fps, ids, n, max);
+    n = collectHandlers(node, topicName, fps, ids, n, max);
+    if ((hash_node = findTopicNode(c, node, "#", 1)) != NULL) /* "a/#" matches "a" too */
+        n = collectHandlers(hash_node, topicName, fps, ids, n, max);
+    return n;
+}
+
+
+/* Called with the write lock held. Fills *fps and *ids, MAX_MESSAGE_HANDLERS entries given by the caller,
+ * with the subscriptions matching topicName: when more match they go to arrays allocated here, to be given
+ * back with releaseMatches. Returns the number of entries filled. */
+static int matchSubscriptions(MQTTClient* c, MQTTString* topicName, messageHandler** fps, int** ids)
+{
+    const char* curn = topicName->lenstring.data;
+    const char* curn_end = curn + topicName->lenstring.len;
+    messageHandler* more_fps;
+    int* more_ids;
+    int n;
+
+    n = matchTopicNodes(c, NULL, curn, curn_end, topicName, *fps, *ids, 0, MAX_MESSAGE_HANDLERS);
+    if (n <= MAX_MESSAGE_HANDLERS)
+        return n;
+    more_fps = MQTTMalloc(n * sizeof(messageHandler));
+    more_ids = MQTTMalloc(n * sizeof(int));
+    if (more_fps == NULL || more_ids == NULL)
+    {
+        if (more_fps != NULL)
+            MQTTFree(more_fps);
+        if (more_ids != NULL)
+            MQTTFree(more_ids);
+        ERROR("no memory for %i matching subscriptions",n);
+        return MAX_MESSAGE_HANDLERS;
+    }
+    *fps = more_fps;
+    *ids = more_ids;
+    return matchTopicNodes(c, NULL, curn, curn_end, topicName, more_fps, more_ids, 0, n);
+}
+
+
+static void releaseMatches(messageHandler* fps, messageHandler* fps_init, int* ids)
+{
+    if (fps != fps_init)
+    {
+        MQTTFree(fps);
+        MQTTFree(ids);
+    }
+}
+
+
+static int writeBuffer(MQTTClient* c, unsigned char* buf, int length, Timer* timer)
 {
     int rc = FAILURE,
         sent = 0;
 
     while (sent < length && !TimerIsExpired(timer))
     {
-        rc = c->ipstack->mqttwrite(c->ipstack, &c->buf[sent], length, TimerLeftMS(timer));
+        rc = c->ipstack->mqttwrite(c->ipstack, &buf[sent], length - sent, TimerLeftMS(timer));
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -56,36 +929,181 @@ static int sendPacket(MQTTClient* c, int length, Timer* timer)
 }
 
 
+/* Called with the write lock held. The gathered packets are dropped on failure too: the connection is lost */
+static int flushWrites(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS;
+
+    if (c->wbuf_len > 0)
+    {
+        rc = writeBuffer(c, (c->wbuf != NULL) ? c->wbuf : c->ackbuf, c->wbuf_len, timer);
+        c->wbuf_len = 0;
+    }
+    return rc;
+}
+
+
+/* Add the packet serialized in c->buf to the ones gathered in buf, written when it is full or delay_ms after the first */
+static int gatherPacket(MQTTClient* c, unsigned char* buf, size_t size, unsigned int delay_ms, int length, Timer* timer)
+{
+    if (c->wbuf_len + length > size && flushWrites(c, timer) != SUCCESS)
+        return FAILURE;
+    if (c->wbuf_len == 0)
+        TimerCountdownMS(&c->wbuf_timer, delay_ms);
+    memcpy(buf + c->wbuf_len, c->buf, length);
+    c->wbuf_len += length;
+    if (c->wbuf_len == size || TimerLeftMS(&c->wbuf_timer) == 0)
+        return flushWrites(c, timer);
+    return SUCCESS;
+}
+
+
+/* Send the packet serialized in c->buf, or gather it in the write buffer if there is one and it fits */
+static int sendPacket(MQTTClient* c, int length, Timer* timer)
+{
+    if (c->wbuf == NULL || (size_t)length > c->wbuf_size)
+        return (flushWrites(c, timer) == SUCCESS) ? writeBuffer(c, c->buf, length, timer) : FAILURE;
+    return gatherPacket(c, c->wbuf, c->wbuf_size, c->wbuf_delay_ms, length, timer);
+}
+
+
+/* Acks to the packets read in a row are gathered even without a write buffer: the reading cycle writes
+ * them once no further packet is buffered, at the latest MAX_ACK_DELAY_MS after the first */
+static int sendAck(MQTTClient* c, int length, Timer* timer)
+{
+    if (c->wbuf != NULL)
+        return sendPacket(c, length, timer);
+    return gatherPacket(c, c->ackbuf, sizeof(c->ackbuf), MAX_ACK_DELAY_MS, length, timer);
+}
+
+
+/* Send a packet made of several buffers, e.g. a publish header from c->buf and the payload from
+ * the caller's memory. The vector is updated in place while partial writes are resumed. */
+static int sendPacketVector(MQTTClient* c, NetworkVector* vec, int count, Timer* timer)
+{
+    int rc = FAILURE;
+
+    if (flushWrites(c, timer) != SUCCESS) /* gathered packets go first */
+        return FAILURE;
+
+    while (count > 0 && !TimerIsExpired(timer))
+    {
+        rc = c->ipstack->mqttwritev(c->ipstack, vec, count, TimerLeftMS(timer));
+        if (rc < 0)  // there was an error writing the data
+            break;
+        while (count > 0 && rc >= vec->len)
+        {
+            rc -= vec->len;
+            ++vec;
+            --count;
+        }
+        if (count > 0)
+        {
+            vec->buf += rc;
+            vec->len -= rc;
+        }
+    }
+    if (count == 0)
+    {
+        TimerCountdown(&c->last_sent, c->keepAliveInterval); // record the fact that we have successfully sent the packet
+        rc = SUCCESS;
+    }
+    else
+        rc = FAILURE;
+    return rc;
+}
+
+
 void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeout_ms,
 		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size)
 {
     int i;
     c->ipstack = network;
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        c->messageHandlers[i].topicFilter = 0;
+    poolInit(&c->handlersPool, c->messageHandlers, sizeof(c->messageHandlers[0]), MAX_MESSAGE_HANDLERS, MESSAGE_HANDLERS_SLAB);
+    poolInit(&c->topicNodesPool, c->topicNodes, sizeof(c->topicNodes[0]), MAX_TOPIC_NODES, TOPIC_NODES_SLAB);
+    for (i = 0; i < MAX_TOPIC_NODES; ++i)
+        c->topicBucketsInit[i] = NULL;
+    c->topicBuckets = c->topicBucketsInit;
+    c->topic_buckets_size = MAX_TOPIC_NODES;
+    c->topic_nodes_count = 0;
     c->command_timeout_ms = command_timeout_ms;
     c->buf = sendbuf;
     c->buf_size = sendbuf_size;
     c->readbuf = readbuf;
     c->readbuf_size = readbuf_size;
+    c->readbuf_start = 0;
+    c->readbuf_end = 0;
+    c->packet = readbuf;
+    c->packet_len = 0;
+    c->streamHandler = NULL;
+    c->stream_chunk = readbuf_size;
+    c->stream_left = 0;
+    c->stream_state = STREAM_IDLE;
+    c->inbound_qos2_count = 0;
+    c->ack_window = 0;
+    c->unacked_count = 0;
+    c->receive_paused = 0;
     c->isconnected = 0;
     c->cleansession = 0;
     c->ping_outstanding = 0;
     c->defaultMessageHandler = NULL;
     c->next_packetid = 1;
+    for (i = 0; i < INFLIGHT_SLOTS; ++i)
+    {
+        c->inflight[i].state = INFLIGHT_FREE;
+        c->inflight[i].resend = NULL;
+    }
+    c->inflight_window = MAX_INFLIGHT_MESSAGES;
+    c->publishCompleteHandler = NULL;
+    c->queue_head = c->queue_tail = NULL;
+    c->queue_budget = c->queue_bytes = 0;
+    c->queue_count = c->queue_dropped = 0;
+    c->queue_policy = QUEUE_DROP_OLDEST;
+    c->persistence = NULL;
+    c->log_buf = NULL;
+    c->wbuf = NULL;
+    c->wbuf_size = c->wbuf_len = 0;
+    c->wbuf_delay_ms = 0;
+    TimerInit(&c->wbuf_timer);
     TimerInit(&c->last_sent);
     TimerInit(&c->last_received);
     TimerInit(&c->ping_resp);
 #if defined(MQTT_TASK)
 	  MutexInit(&c->mutex);
+	  MutexInit(&c->write_mutex);
+	  SemaphoreInit(&c->ack_sem);
+	  c->ack_waiters = 0;
 #endif
 }
 
 
-static int decodePacket(MQTTClient* c, int* value, int timeout)
+/* Pull as many bytes as the socket has into the free tail of readbuf, waiting up to the timer for
+ * the first one. Buffered bytes of an incomplete packet are moved to the front when the tail is full.
+ * Returns the number of bytes read, 0 on timeout, < 0 on network errors. */
+static int fillReadBuffer(MQTTClient* c, Timer* timer)
 {
-    unsigned char i;
+    int rc;
+
+    if (c->readbuf_end == c->readbuf_size && c->readbuf_start > 0)
+    {
+        memmove(c->readbuf, c->readbuf + c->readbuf_start, c->readbuf_end - c->readbuf_start);
+        c->readbuf_end -= c->readbuf_start;
+        c->readbuf_start = 0;
+    }
+    rc = c->ipstack->mqttrecv(c->ipstack, c->readbuf + c->readbuf_end, c->readbuf_size - c->readbuf_end, TimerLeftMS(timer));
+    if (rc > 0)
+        c->readbuf_end += rc;
+    return rc;
+}
+
+
+/* Decode the remaining length of the packet buffered at start.
+ * Returns the number of remaining length bytes, 0 if more bytes must be read first. */
+static int decodePacket(MQTTClient* c, size_t start, int* value)
+{
+    unsigned char* ptr = c->readbuf + start + 1;
+    int buffered = (int)(c->readbuf_end - start) - 1;
     int multiplier = 1;
     int len = 0;
     const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
@@ -93,58 +1111,379 @@ static int decodePacket(MQTTClient* c, int* value, int timeout)
     *value = 0;
     do
     {
-        int rc = MQTTPACKET_READ_ERROR;
+        if (len >= MAX_NO_OF_REMAINING_LENGTH_BYTES)
+            return MQTTPACKET_READ_ERROR; /* bad data */
+        if (len >= buffered)
+            return 0;
+        *value += (ptr[len] & 127) * multiplier;
+        multiplier *= 128;
+    } while ((ptr[len++] & 128) != 0);
+    return len;
+}
+
+
+static int isInboundHeld(MQTTClient* c);
+
+
+/* Is the packet following the one being handled already complete in readbuf, and can it be handled? */
+static int packetBuffered(MQTTClient* c)
+{
+    size_t start = c->readbuf_start + c->packet_len;
+    size_t buffered = c->readbuf_end - start;
+    unsigned char* ptr = c->readbuf + start + 1;
+    size_t rem_len = 0, multiplier = 1, len = 0;
+
+    if (buffered > 0 && (ptr[-1] >> 4) == PUBLISH && isInboundHeld(c))
+        return 0;
+    do
+    {
+        if (len >= 4 || len + 1 >= buffered)
+            return 0;
+        rem_len += (ptr[len] & 127) * multiplier;
+        multiplier *= 128;
+    } while ((ptr[len++] & 128) != 0);
+    return 1 + len + rem_len <= buffered;
+}
+
+
+static void consumeReadBuffer(MQTTClient* c, size_t len)
+{
+    c->readbuf_start += len;
+    if (c->readbuf_start == c->readbuf_end)
+        c->readbuf_start = c->readbuf_end = 0;
+}
+
+
+/* Received QoS2 messages are delivered once: their ids are kept from the PUBREC to the PUBREL,
+ * and a PUBLISH sent again in between is only acked. Called with c->mutex held. */
+static int isInboundPending(MQTTClient* c, unsigned short packetid)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->inbound_qos2_count; ++i)
+    {
+        if (c->inbound_qos2[i] == packetid)
+            return 1;
+    }
+    return 0;
+}
+
+
+static void forgetInbound(MQTTClient* c, unsigned short packetid)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->inbound_qos2_count; ++i)
+    {
+        if (c->inbound_qos2[i] == packetid)
+        {
+            memmove(&c->inbound_qos2[i], &c->inbound_qos2[i + 1], (--c->inbound_qos2_count - i) * sizeof(unsigned short));
+            return;
+        }
+    }
+}
+
+
+static void rememberInbound(MQTTClient* c, unsigned short packetid)
+{
+    if (isInboundPending(c, packetid))
+        return;
+    if (c->inbound_qos2_count == MAX_INBOUND_QOS2)
+        forgetInbound(c, c->inbound_qos2[0]); /* the broker has long moved on from the oldest one */
+    c->inbound_qos2[c->inbound_qos2_count++] = packetid;
+}
+
+
+/* With manual acks, received messages wait for MQTTAck with their ids kept here, under the write lock */
+static int isUnacked(MQTTClient* c, unsigned short packetid)
+{
+    unsigned int i;
+    int rc = 0;
+
+    lockWrite(c);
+    for (i = 0; i < c->unacked_count && !rc; ++i)
+        rc = (c->unacked_ids[i] == packetid);
+    unlockWrite(c);
+    return rc;
+}
+
+
+/* No further publish can be taken: the manual ack window is full or receiving is paused */
+static int isInboundHeld(MQTTClient* c)
+{
+    return c->receive_paused || (c->ack_window > 0 && c->unacked_count >= c->ack_window);
+}
+
+
+/* A packet bigger than readbuf: a PUBLISH matching a subscription goes to the stream handler once its topic is
+ * buffered, anything else is skipped so that the following packets can still be read, acked if it is a QoS1/QoS2
+ * publish. Nothing is consumed until the handler accepts the message, a timeout just retries on the next cycle. */
+static int beginStream(MQTTClient* c, int len, int rem_len, Timer* timer)
+{
+    MQTTHeader header = {0};
+    int rc = 0;
+
+    header.byte = c->readbuf[c->readbuf_start];
+    if (header.bits.type == PUBLISH)
+    {
+        unsigned char* ptr;
+        int topic_len, hdr_len;
+
+        while ((int)(c->readbuf_end - c->readbuf_start) < len + 2)
+        {
+            if ((rc = fillReadBuffer(c, timer)) <= 0)
+                return rc;
+        }
+        ptr = c->readbuf + c->readbuf_start + len;
+        topic_len = (ptr[0] << 8) + ptr[1];
+        hdr_len = len + 2 + topic_len + ((header.bits.qos > 0) ? 2 : 0);
+        if (hdr_len <= (int)c->readbuf_size && hdr_len <= len + rem_len)
+        {
+            MQTTString topicName = MQTTString_initializer;
+            MessageData md;
+            messageHandler fps_init[MAX_MESSAGE_HANDLERS], *fps = fps_init;
+            int ids_init[MAX_MESSAGE_HANDLERS], *ids = ids_init;
+
+            while ((int)(c->readbuf_end - c->readbuf_start) < hdr_len)
+            {
+                if ((rc = fillReadBuffer(c, timer)) <= 0)
+                    return rc;
+            }
+            ptr = c->readbuf + c->readbuf_start + len; /* the buffer may have been compacted */
+            topicName.lenstring.len = topic_len;
+            topicName.lenstring.data = (char*)ptr + 2;
+            c->stream_msg.qos = (enum QoS)header.bits.qos;
+            c->stream_msg.dup = header.bits.dup;
+            c->stream_msg.retained = header.bits.retain;
+            c->stream_msg.id = (header.bits.qos > 0) ? (ptr[2 + topic_len] << 8) + ptr[3 + topic_len] : 0;
+            c->stream_msg.payload = NULL;
+            c->stream_msg.payloadlen = len + rem_len - hdr_len;
+            NewMessageData(&md, &topicName, &c->stream_msg);
+            if (c->streamHandler != NULL &&
+                !(c->stream_msg.qos == QOS2 && isInboundPending(c, c->stream_msg.id)) &&
+                !(c->stream_msg.qos != QOS0 && isUnacked(c, c->stream_msg.id)))
+            {
+                lockWrite(c);
+                md.subscription_count = matchSubscriptions(c, &topicName, &fps, &ids);
+                unlockWrite(c);
+                md.subscriptions = ids;
+            }
+            if (md.subscription_count == 0)
+            {
+                /* a duplicate, or nobody to deliver to: only the ack is left */
+                consumeReadBuffer(c, hdr_len);
+                c->stream_state = (c->stream_msg.qos != QOS0) ? STREAM_SKIP_ACK : STREAM_SKIP;
+                c->stream_left = c->stream_msg.payloadlen;
+                return 0;
+            }
+            rc = c->streamHandler(STREAM_BEGIN, &md);
+            releaseMatches(fps, fps_init, ids);
+            if (rc < 0)
+                return 0;
+            consumeReadBuffer(c, hdr_len);
+            c->stream_state = STREAM_DELIVER;
+            c->stream_left = c->stream_msg.payloadlen;
+            return 0;
+        }
+        if (header.bits.qos > 0)
+        {
+            /* without its packet id it can't be acked: the broker would send it again on every connection */
+            ERROR("publish topic too long %i",topic_len);
+            return FAILURE;
+        }
+    }
+    ERROR("packet too big %i",len + rem_len);
+    c->stream_state = STREAM_SKIP;
+    c->stream_left = len + rem_len;
+    return 0;
+}
+
+
+/* Continue the oversized packet started by beginStream: one chunk of payload per call.
+ * Returns PUBLISH once the whole message has been delivered and only its ack is left. */
+static int streamPayload(MQTTClient* c, Timer* timer)
+{
+    MessageData md;
+    size_t chunk;
+    int rc = 0;
+
+    if (c->stream_state == STREAM_DELIVER && c->streamHandler == NULL) /* nobody to deliver to anymore */
+        c->stream_state = (c->stream_msg.qos != QOS0) ? STREAM_SKIP_ACK : STREAM_SKIP;
+
+    if (c->stream_state == STREAM_SKIP || c->stream_state == STREAM_SKIP_ACK)
+    {
+        for (;;)
+        {
+            chunk = c->readbuf_end - c->readbuf_start;
+            if (chunk > c->stream_left)
+                chunk = c->stream_left;
+            consumeReadBuffer(c, chunk);
+            c->stream_left -= chunk;
+            if (c->stream_left == 0)
+            {
+                /* a skipped QoS1/QoS2 message still needs its ack */
+                rc = (c->stream_state == STREAM_SKIP_ACK) ? PUBLISH : 0;
+                c->stream_state = STREAM_IDLE;
+                return rc;
+            }
+            if ((rc = fillReadBuffer(c, timer)) <= 0)
+                return rc;
+        }
+    }
+
+    if (c->stream_left > 0)
+    {
+        chunk = (c->stream_left < c->stream_chunk) ? c->stream_left : c->stream_chunk;
+        while (c->readbuf_end - c->readbuf_start < chunk)
+        {
+            if ((rc = fillReadBuffer(c, timer)) <= 0)
+                return rc;
+        }
+        c->stream_msg.payload = c->readbuf + c->readbuf_start;
+        c->stream_msg.payloadlen = chunk;
+        NewMessageData(&md, NULL, &c->stream_msg);
+        if (c->streamHandler(STREAM_DATA, &md) < 0)
+            return 0; /* consumer busy, the same chunk is offered again */
+        consumeReadBuffer(c, chunk);
+        c->stream_left -= chunk;
+        return 0;
+    }
+
+    c->stream_msg.payload = NULL;
+    c->stream_msg.payloadlen = 0;
+    NewMessageData(&md, NULL, &c->stream_msg);
+    if (c->streamHandler(STREAM_END, &md) < 0)
+        return 0;
+    c->stream_state = STREAM_IDLE;
+    return PUBLISH;
+}
+
+
+static void reverseBytes(unsigned char* p, size_t len)
+{
+    unsigned char* q = p + len;
+
+    while (p < q && p < --q)
+    {
+        unsigned char b = *p;
+        *p++ = *q;
+        *q = b;
+    }
+}
+
+
+/* The PUBLISH of held_len bytes at the front of readbuf can't be taken yet: the first packet behind it that isn't
+ * a publish is moved in front of it to be handled, so that acks, subscription results and ping responses are not
+ * held too, as long as it fits in readbuf with the publishes before it, which keep their order. With MQTT_TASK
+ * the socket is only polled, acks from the application wake the reader up through ack_sem.
+ * Returns 1 if a packet was moved, 0 if there is none yet. */
+static int readBehindHeld(MQTTClient* c, size_t held_len, Timer* timer)
+{
+    size_t held = held_len;
+    int len, rem_len, rc;
+
+#if defined(MQTT_TASK)
+    Timer poll;
+
+    TimerInit(&poll);
+    TimerCountdownMS(&poll, 0);
+    timer = &poll;
+#endif
+    for (;;)
+    {
+        size_t next = c->readbuf_start + held, packet_len;
 
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+        if (c->readbuf_end > next && (len = decodePacket(c, next, &rem_len)) != 0)
         {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
+            if (len < 0)
+                return FAILURE;
+            packet_len = 1 + len + rem_len;
+            if (held + packet_len > c->readbuf_size)
+                return 0;
+            if (next + packet_len <= c->readbuf_end)
+            {
+                if ((c->readbuf[next] >> 4) == PUBLISH)
+                {
+                    held += packet_len;
+                    continue;
+                }
+                /* rotate [held][next] into [next][held] */
+                reverseBytes(c->readbuf + c->readbuf_start, held);
+                reverseBytes(c->readbuf + next, packet_len);
+                reverseBytes(c->readbuf + c->readbuf_start, held + packet_len);
+                return 1;
+            }
         }
-        rc = c->ipstack->mqttread(c->ipstack, &i, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (i & 127) * multiplier;
-        multiplier *= 128;
-    } while ((i & 128) != 0);
-exit:
-    return len;
+        if (c->readbuf_start == 0 && c->readbuf_end == c->readbuf_size)
+            return 0;
+        if ((rc = fillReadBuffer(c, timer)) <= 0)
+            return rc;
+    }
 }
 
 
+/* Packets are parsed in place from readbuf, which buffers whatever the socket delivered:
+ * a burst of small packets costs a single recv. The packet returned by the previous call
+ * stays valid (c->packet) until the next one. */
 static int readPacket(MQTTClient* c, Timer* timer)
 {
     MQTTHeader header = {0};
     int len = 0;
     int rem_len = 0;
+    int rc = 0;
 
-    /* 1. read the header byte.  This has the packet type in it */
+    /* 0. drop the packet handled by the previous cycle */
+    consumeReadBuffer(c, c->packet_len);
+    c->packet_len = 0;
+
+    /* 1. the header byte and the remaining length, which is variable in itself */
     DEBUG0("Reading packet","");
-    int rc = c->ipstack->mqttread(c->ipstack, c->readbuf, 1, TimerLeftMS(timer));
-    if (rc != 1){
-        ERROR("bad read %i",rc);
+    while ((len = decodePacket(c, c->readbuf_start, &rem_len)) == 0)
+    {
+        if ((rc = fillReadBuffer(c, timer)) <= 0){
+            if (rc < 0)
+                ERROR("bad read %i",rc);
+            goto exit;
+        }
+    }
+    if (len < 0)
+    {
+        rc = FAILURE;
+        ERROR("bad remaining length","");
         goto exit;
     }
+    len += 1;
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(c, &rem_len, TimerLeftMS(timer));
-    len += MQTTPacket_encode(c->readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
+    header.byte = c->readbuf[c->readbuf_start];
+    if (header.bits.type == PUBLISH && (header.bits.qos > 0 || c->receive_paused) && isInboundHeld(c))
+    {
+        /* the message stays buffered until the application acks one or resumes receiving, other packets
+           behind it go first if they fit in readbuf with it */
+        rc = 0;
+        if (rem_len > (c->readbuf_size - len) ||
+            (rc = readBehindHeld(c, len + rem_len, timer)) <= 0)
+            goto exit;
+        len = decodePacket(c, c->readbuf_start, &rem_len) + 1;
+    }
 
     if (rem_len > (c->readbuf_size - len))
     {
-        rc = BUFFER_OVERFLOW;
-        ERROR("packet too big %i",rc);
+        rc = beginStream(c, len, rem_len, timer);
         goto exit;
     }
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (rc = c->ipstack->mqttread(c->ipstack, c->readbuf + len, rem_len, TimerLeftMS(timer)) != rem_len)) {
-        DEBUG1("Read packet case 3 %i %i",rc,rem_len);
-        rc = 0;
-        goto exit;
+    /* 2. the rest of the packet, a timeout leaves the partial packet buffered for the next cycle */
+    while (c->readbuf_end - c->readbuf_start < len + rem_len)
+    {
+        if ((rc = fillReadBuffer(c, timer)) <= 0) {
+            DEBUG1("Read packet case 2 %i %i",rc,rem_len);
+            goto exit;
+        }
     }
 
-    header.byte = c->readbuf[0];
+    c->packet = c->readbuf + c->readbuf_start;
+    c->packet_len = len + rem_len;
+    header.byte = c->packet[0];
     rc = header.bits.type;
     if (c->keepAliveInterval > 0) {
         DEBUG1("Mark keepalive for packet type %i",rc);
@@ -155,66 +1494,52 @@ exit:
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-static char isTopicMatched(char* topicFilter, MQTTString* topicName)
-{
-    char* curf = topicFilter;
-    char* curn = topicName->lenstring.data;
-    char* curn_end = curn + topicName->lenstring.len;
-
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
-}
-
-
 int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message)
 {
-    int i;
+    int i, j, n, matched, subscribed;
     int rc = FAILURE;
+    messageHandler fps_init[MAX_MESSAGE_HANDLERS], *fps = fps_init;
+    int ids_init[MAX_MESSAGE_HANDLERS], *ids = ids_init;
 
     // we have to find the right message handler - indexed by topic
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    // handlers are called without the write lock, they may publish
+    lockWrite(c);
+    matched = subscribed = matchSubscriptions(c, topicName, &fps, &ids);
+    if (matched == 0 && c->defaultMessageHandler != NULL)
+        fps[matched++] = c->defaultMessageHandler;
+    unlockWrite(c);
+
+    // each handler is called once, with the ids of all its matching subscriptions
+    for (i = 0; i < matched; ++i)
     {
-        if (c->messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(topicName, (char*)c->messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)c->messageHandlers[i].topicFilter, topicName)))
+        MessageData md;
+
+        if (fps[i] == NULL)
+            continue;
+        for (j = i + 1, n = i + 1; j < matched; ++j)
         {
-            if (c->messageHandlers[i].fp != NULL)
+            if (fps[j] == fps[i])
             {
-                MessageData md;
-                NewMessageData(&md, topicName, message);
-                c->messageHandlers[i].fp(&md);
-                rc = SUCCESS;
+                int id = ids[j];
+
+                ids[j] = ids[n]; /* bring it next to the others, the swapped entry is still to be seen */
+                fps[j] = fps[n];
+                ids[n] = id;
+                fps[n++] = fps[i];
             }
         }
-    }
-
-    if (rc == FAILURE && c->defaultMessageHandler != NULL)
-    {
-        MessageData md;
         NewMessageData(&md, topicName, message);
-        c->defaultMessageHandler(&md);
+        if (subscribed)
+        {
+            md.subscriptions = &ids[i];
+            md.subscription_count = n - i;
+        }
+        fps[i](&md);
         rc = SUCCESS;
+        i = n - 1;
     }
 
+    releaseMatches(fps, fps_init, ids);
     return rc;
 }
 
@@ -226,6 +1551,7 @@ int keepalive(MQTTClient* c)
     if (c->keepAliveInterval == 0)
         goto exit;
 
+    lockWrite(c);
     if (TimerIsExpired(&c->last_sent) || TimerIsExpired(&c->last_received))
     {
         //added patch with ping grace period for slow connections
@@ -237,7 +1563,7 @@ int keepalive(MQTTClient* c)
             TimerInit(&timer);
             TimerCountdownMS(&timer, 1000);
             int len = MQTTSerialize_pingreq(c->buf, c->buf_size);
-            if (len > 0 && (rc = sendPacket(c, len, &timer)) == SUCCESS) {
+            if (len > 0 && (rc = sendPacket(c, len, &timer)) == SUCCESS && (rc = flushWrites(c, &timer)) == SUCCESS) {
                 // send the ping packet 
                 c->ping_outstanding = 1;
                 // set 5 seconds of grace period
@@ -245,6 +1571,7 @@ int keepalive(MQTTClient* c)
             }
         }
     }
+    unlockWrite(c);
 
 exit:
     return rc;
@@ -253,29 +1580,70 @@ exit:
 
 void MQTTCleanSession(MQTTClient* c)
 {
-    int i = 0;
+    unsigned int i;
+
+    for (i = 0; i < c->topic_buckets_size; ++i)
+    {
+        struct TopicNodes* node;
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        c->messageHandlers[i].topicFilter = NULL;
+        while ((node = c->topicBuckets[i]) != NULL)
+        {
+            struct MessageHandlers* h;
+
+            while ((h = node->handlers) != NULL)
+            {
+                node->handlers = h->next;
+                MQTTFree(h->topicFilter);
+                poolFree(&c->handlersPool, h);
+            }
+            c->topicBuckets[i] = node->next;
+            freeTopicNode(c, node);
+        }
+    }
+    c->topic_nodes_count = 0;
 }
 
 
+/* called with the write lock held */
 void MQTTCloseSession(MQTTClient* c)
 {
+    int i;
+
+    /* exchanges in progress can't be completed on a new connection, unless the broker keeps the
+       session: then the publishes nobody waits for are resumed by the next connect */
+    for (i = 0; i < INFLIGHT_SLOTS; ++i)
+    {
+        unsigned char state = c->inflight[i].state;
+
+        if (!c->cleansession && isPublishState(state) && !c->inflight[i].waiting &&
+            (state == INFLIGHT_WAIT_PUBCOMP || c->inflight[i].resend != NULL))
+            continue;
+        if (state != INFLIGHT_FREE && state != INFLIGHT_DONE)
+            completeInflight(c, i, FAILURE);
+    }
     c->ping_outstanding = 0;
     c->isconnected = 0;
+    c->wbuf_len = 0;
     if (c->cleansession)
         MQTTCleanSession(c);
+    notifyWaiters(c);
 }
 
 
+/* called with c->mutex held: only one task at a time reads the network */
 int cycle(MQTTClient* c, Timer* timer)
 {
     int len = 0,
         rc = SUCCESS;
+    int streaming = (c->stream_state != STREAM_IDLE);
+    int stream_delivered = (c->stream_state == STREAM_DELIVER && c->streamHandler != NULL);
+    Timer ack_timer;
 
-    int packet_type = readPacket(c, timer);     /* read the socket, see what work is due */
+    int packet_type = (streaming) ? streamPayload(c, timer) : readPacket(c, timer);     /* read the socket, see what work is due */
     DEBUG0("Packet type %i %x",packet_type,packet_type);
+    /* the read timer runs up to the next deadline and can be about to expire when a packet comes in */
+    TimerInit(&ack_timer);
+    TimerCountdownMS(&ack_timer, c->command_timeout_ms);
     switch (packet_type)
     {
         default:
@@ -283,33 +1651,113 @@ int cycle(MQTTClient* c, Timer* timer)
             rc = packet_type;
             goto exit;
         case 0: /* timed out reading packet */
+            if (c->log_buffered > 0 || (c->persistence != NULL && logNeedsCompaction(c)))
+            {
+                /* idle: the batched log records can go to storage, and a log of mostly acked messages
+                   be compacted */
+                lockWrite(c);
+                if (c->persistence != NULL && logNeedsCompaction(c))
+                    compactLog(c);
+                else if (c->persistence != NULL)
+                    flushLog(c);
+                unlockWrite(c);
+            }
+#if defined(MQTT_TASK)
+            if (isInboundHeld(c) && !TimerIsExpired(timer))
+            {
+                /* no publish can be read before the application acks a message or resumes receiving,
+                   the packets behind it are checked again after a while */
+                int wait = TimerLeftMS(timer);
+
+                lockWrite(c);
+                c->ack_waiters++;
+                unlockWrite(c);
+                SemaphoreWait(&c->ack_sem, (wait < HELD_READ_POLL_MS) ? wait : HELD_READ_POLL_MS);
+            }
+#endif
             break;
         case CONNACK:
+            break;
         case PUBACK:
+        case PUBCOMP:
         case SUBACK:
         case UNSUBACK:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type, state;
+            int i, result = SUCCESS;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->packet, c->packet_len) != 1)
+            {
+                rc = FAILURE;
+                goto exit;
+            }
+            if (packet_type == SUBACK)
+                state = INFLIGHT_WAIT_SUBACK;
+            else if (packet_type == UNSUBACK)
+                state = INFLIGHT_WAIT_UNSUBACK;
+            else
+                state = (packet_type == PUBACK) ? INFLIGHT_WAIT_PUBACK : INFLIGHT_WAIT_PUBCOMP;
+            lockWrite(c);
+            if ((i = findInflight(c, mypacketid)) >= 0 && c->inflight[i].state == state)
+            {
+                if (packet_type == SUBACK)
+                {
+                    /* one granted QoS per topic filter, straight into the subscriber's vector */
+                    int count = 0;
+                    if (MQTTDeserialize_suback(&mypacketid, c->inflight[i].count, &count, c->inflight[i].granted,
+                            c->packet, c->packet_len) != 1 || count != c->inflight[i].count)
+                        result = FAILURE;
+                }
+                completeInflight(c, i, result);
+                notifyWaiters(c);
+            }
+            unlockWrite(c);
             break;
+        }
         case PUBLISH:
         {
             MQTTString topicName;
             MQTTMessage msg;
-            int intQoS;
-            msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
-            if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
-               (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->readbuf, c->readbuf_size) != 1)
-                goto exit;
-            msg.qos = (enum QoS)intQoS;
-            deliverMessage(c, &topicName, &msg);
-            if (msg.qos != QOS0)
+            int intQoS, held, delivered = 0;
+            if (streaming)
+                msg = c->stream_msg; /* already delivered in chunks, only the ack is left */
+            else
+            {
+                msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
+                if (MQTTDeserialize_publish(&msg.dup, &intQoS, &msg.retained, &msg.id, &topicName,
+                   (unsigned char**)&msg.payload, (int*)&msg.payloadlen, c->packet, c->packet_len) != 1)
+                    goto exit;
+                msg.qos = (enum QoS)intQoS;
+            }
+            /* sent again while waiting for its manual ack: MQTTAck answers it */
+            held = (msg.qos != QOS0 && isUnacked(c, msg.id));
+            if (streaming)
+                delivered = stream_delivered;
+            else if (!held && (msg.qos != QOS2 || !isInboundPending(c, msg.id)))
+            {
+                deliverMessage(c, &topicName, &msg);
+                delivered = 1;
+            }
+            if (msg.qos == QOS2)
+                rememberInbound(c, msg.id);
+            if (msg.qos != QOS0 && !held)
             {
-                if (msg.qos == QOS1)
+                lockWrite(c);
+                if (delivered && c->ack_window > 0 && c->unacked_count < MAX_UNACKED_INBOUND)
+                {
+                    c->unacked_ids[c->unacked_count] = msg.id;
+                    c->unacked_qos[c->unacked_count++] = (unsigned char)msg.qos;
+                    len = 0;
+                }
+                else if (msg.qos == QOS1)
                     len = MQTTSerialize_ack(c->buf, c->buf_size, PUBACK, 0, msg.id);
                 else if (msg.qos == QOS2)
                     len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREC, 0, msg.id);
-                if (len <= 0)
+                if (len < 0)
                     rc = FAILURE;
-                else
-                    rc = sendPacket(c, len, timer);
+                else if (len > 0)
+                    rc = sendAck(c, len, &ack_timer);
+                unlockWrite(c);
                 if (rc == FAILURE)
                     goto exit; // there was a problem
             }
@@ -320,25 +1768,54 @@ int cycle(MQTTClient* c, Timer* timer)
         {
             unsigned short mypacketid;
             unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
+            int i;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->packet, c->packet_len) != 1)
+            {
                 rc = FAILURE;
-            else if ((len = MQTTSerialize_ack(c->buf, c->buf_size,
+                goto exit;
+            }
+            if (packet_type == PUBREL)
+                forgetInbound(c, mypacketid);
+            lockWrite(c);
+            if ((len = MQTTSerialize_ack(c->buf, c->buf_size,
                 (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
                 rc = FAILURE;
-            else if ((rc = sendPacket(c, len, timer)) != SUCCESS) // send the PUBREL packet
+            else if ((rc = sendAck(c, len, &ack_timer)) != SUCCESS) // send the PUBREL packet
                 rc = FAILURE; // there was a problem
+            else if (packet_type == PUBREC && (i = findInflight(c, mypacketid)) >= 0 &&
+                c->inflight[i].state == INFLIGHT_WAIT_PUBREC)
+            {
+                c->inflight[i].state = INFLIGHT_WAIT_PUBCOMP;
+                if (c->inflight[i].resend != NULL)
+                {
+                    /* the broker has the message, only the PUBREL can be sent again */
+                    MQTTFree(c->inflight[i].resend);
+                    c->inflight[i].resend = NULL;
+                }
+            }
+            unlockWrite(c);
             if (rc == FAILURE)
                 goto exit; // there was a problem
             break;
         }
 
-        case PUBCOMP:
-            break;
         case PINGRESP:
             c->ping_outstanding = 0;
             break;
     }
 
+    if (c->wbuf_len > 0)
+    {
+        /* what was gathered has waited long enough, or acks have no more packets to wait for */
+        lockWrite(c);
+        if ((TimerLeftMS(&c->wbuf_timer) == 0 || (c->wbuf == NULL && !packetBuffered(c))) &&
+            flushWrites(c, &ack_timer) != SUCCESS)
+            rc = FAILURE;
+        unlockWrite(c);
+        if (rc == FAILURE)
+            goto exit;
+    }
+
     if (keepalive(c) != SUCCESS) {
         //check only keepalive FAILURE status so that previous FAILURE status can be considered as FAULT
         ERROR("Failed keepalive","");
@@ -349,7 +1826,11 @@ exit:
     if (rc == SUCCESS)
         rc = packet_type;
     else if (c->isconnected)
+    {
+        lockWrite(c);
         MQTTCloseSession(c);
+        unlockWrite(c);
+    }
     return rc;
 }
 
@@ -379,6 +1860,37 @@ int MQTTIsConnected(MQTTClient* client)
   return client->isconnected;
 }
 
+
+int MQTTNextDeadline(MQTTClient* c)
+{
+    int left = MAX_IDLE_WAIT_MS;
+
+    lockWrite(c);
+    if (c->log_buffered > 0)
+        left = 0; /* flushed as soon as the read times out */
+    else if (c->isconnected && c->keepAliveInterval > 0)
+    {
+        int ms;
+
+        if (c->ping_outstanding)
+            left = TimerLeftMS(&c->ping_resp);
+        else
+        {
+            left = TimerLeftMS(&c->last_sent);
+            if ((ms = TimerLeftMS(&c->last_received)) < left)
+                left = ms;
+        }
+        if (left > MAX_IDLE_WAIT_MS)
+            left = MAX_IDLE_WAIT_MS;
+    }
+    if (c->wbuf_len > 0 && TimerLeftMS(&c->wbuf_timer) < left)
+        left = TimerLeftMS(&c->wbuf_timer);
+    else if (c->wbuf != NULL && (int)c->wbuf_delay_ms < left)
+        left = c->wbuf_delay_ms; /* other tasks can gather packets while the reader is blocked */
+    unlockWrite(c);
+    return left;
+}
+
 void MQTTRun(void* parm)
 {
 	Timer timer;
@@ -391,10 +1903,10 @@ void MQTTRun(void* parm)
 #if defined(MQTT_TASK)
 		MutexLock(&c->mutex);
 #endif
-		TimerCountdownMS(&timer, 500); /* Don't wait too long if no traffic is incoming */
+		TimerCountdownMS(&timer, MQTTNextDeadline(c)); /* block until traffic comes in or keepalive is due */
 		cycle(c, &timer);
 #if defined(MQTT_TASK)
-        MutexUnlock(&c->mutex);
+        MQTTReleaseReader(c);
 #endif
 	}
 }
@@ -424,6 +1936,311 @@ int waitfor(MQTTClient* c, int packet_type, Timer* timer)
 }
 
 
+/* Called with the write lock held, returns with the write lock held.
+ * Lets the reading side make progress: if no other task is reading the network we cycle ourselves,
+ * otherwise we sleep until the reading task completes some exchange or the connection drops. */
+static int waitforProgress(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS;
+
+    if (TimerIsExpired(timer) || !c->isconnected)
+        return FAILURE;
+    /* no answer can come to packets still gathered */
+    if (flushWrites(c, timer) != SUCCESS)
+        return FAILURE;
+#if defined(MQTT_TASK)
+    if (MutexTryLock(&c->mutex) == 0)
+    {
+        unlockWrite(c);
+        rc = cycle(c, timer);
+        MQTTReleaseReader(c);
+        lockWrite(c);
+    }
+    else
+    {
+        c->ack_waiters++;
+        unlockWrite(c);
+        SemaphoreWait(&c->ack_sem, TimerLeftMS(timer));
+        lockWrite(c);
+    }
+#else
+    rc = cycle(c, timer);
+#endif
+    return (rc < 0) ? FAILURE : SUCCESS;
+}
+
+
+/* Called with the write lock held: reserve an in-flight slot, waiting for one if needed */
+static int reserveInflight(MQTTClient* c, unsigned char state, int waiting, Timer* timer)
+{
+    int i;
+
+    while ((i = findFreeInflight(c, isPublishState(state))) < 0)
+    {
+        if (waitforProgress(c, timer) != SUCCESS)
+            return -1;
+    }
+    if (!c->isconnected)
+        return -1;
+    c->inflight[i].id = getNextPacketId(c);
+    c->inflight[i].state = state;
+    c->inflight[i].waiting = waiting;
+    c->inflight[i].rc = FAILURE;
+    c->inflight[i].record.seq = 0;
+    return i;
+}
+
+
+/* Called with the write lock held: wait for the reading side to complete the exchange in slot i.
+ * The slot is released and the outcome of the exchange returned. */
+static int waitforInflight(MQTTClient* c, int i, Timer* timer)
+{
+    int rc;
+
+    while (c->inflight[i].state != INFLIGHT_DONE)
+    {
+        if (waitforProgress(c, timer) != SUCCESS && c->inflight[i].state != INFLIGHT_DONE)
+        {
+            /* timed out or disconnected: take the exchange out of the table ourselves */
+            c->inflight[i].waiting = 0;
+            return completeInflight(c, i, FAILURE);
+        }
+    }
+    rc = c->inflight[i].rc;
+    c->inflight[i].state = INFLIGHT_FREE;
+    return rc;
+}
+
+
+/* The publish path takes topics in their lenstring form, zero terminated, so that the length of a topic
+ * prepared once is not measured again for every message */
+static MQTTString topicString(const char* topicName)
+{
+    MQTTString topic = MQTTString_initializer;
+
+    topic.lenstring.len = strlen(topicName);
+    topic.lenstring.data = (char*)topicName;
+    return topic;
+}
+
+
+/* Copy a message in a single allocation: topic and payload follow the entry */
+static MQTTQueuedMessage* copyMessage(MQTTString* topic, MQTTMessage* message)
+{
+    size_t topic_len = topic->lenstring.len + 1;
+    size_t size = sizeof(MQTTQueuedMessage) + topic_len + message->payloadlen;
+    MQTTQueuedMessage* q;
+
+    if ((q = MQTTMalloc(size)) == NULL)
+        return NULL;
+    q->size = size;
+    q->topicName = (char*)(q + 1);
+    memcpy(q->topicName, topic->lenstring.data, topic_len);
+    q->message = *message;
+    q->message.payload = q->topicName + topic_len;
+    if (message->payloadlen > 0)
+        memcpy(q->message.payload, message->payload, message->payloadlen);
+    q->record.seq = 0;
+    return q;
+}
+
+
+/* Called with the write lock held: serialize and send a publish packet */
+static int writePublish(MQTTClient* c, MQTTString* topic, MQTTMessage* message, unsigned char dup, Timer* timer)
+{
+    int len = 0;
+
+    if (c->ipstack->mqttwritev != NULL &&
+        MQTTPacket_len(MQTTSerialize_publishLength(message->qos, *topic, message->payloadlen)) > c->buf_size)
+    {
+        // only the header goes through c->buf, the payload is sent from where it is: no copy, and
+        // no limit on its size from the send buffer. Packets that fit are still copied and sent at once,
+        // a separate small write would be held back by Nagle until the header is acked
+        NetworkVector vec[2];
+
+        len = MQTTSerialize_publishHeader(c->buf, c->buf_size, dup, message->qos, message->retained, message->id,
+              *topic, message->payloadlen);
+        if (len <= 0)
+            return FAILURE;
+        vec[0].buf = c->buf;
+        vec[0].len = len;
+        vec[1].buf = (unsigned char*)message->payload;
+        vec[1].len = message->payloadlen;
+        return sendPacketVector(c, vec, (message->payloadlen > 0) ? 2 : 1, timer);
+    }
+    len = MQTTSerialize_publish(c->buf, c->buf_size, dup, message->qos, message->retained, message->id,
+          *topic, (unsigned char*)message->payload, message->payloadlen);
+    if (len <= 0)
+        return FAILURE;
+    return sendPacket(c, len, timer);
+}
+
+
+/* Whether writePublish can serialize a publish: whole in c->buf, or with a vectored write only its header */
+static int publishFits(MQTTClient* c, MQTTString* topic, MQTTMessage* message)
+{
+    size_t len = MQTTPacket_len(MQTTSerialize_publishLength(message->qos, *topic, message->payloadlen));
+
+    if (len <= c->buf_size)
+        return 1;
+    return c->ipstack->mqttwritev != NULL && len - message->payloadlen <= c->buf_size;
+}
+
+
+/* Called with the write lock held: reserve the in-flight slot of a QoS1/QoS2 publish and send it.
+ * *slot is set to the slot reserved, -1 for QoS0. The slot takes over the log record of the message, or with
+ * record NULL logs the message itself when persistence is set, and keeps a copy of it to resume the session
+ * after a lost connection, unless the session is clean.
+ * Once a slot is reserved the message is its own even if the send fails: the exchange completes from there.
+ * A message that can't be serialized with this buffer fails with BUFFER_OVERFLOW before taking a slot, that
+ * would otherwise resend it in vain with every session. */
+static int sendPublish(MQTTClient* c, MQTTString* topic, MQTTMessage* message, MQTTLogRecord* record,
+    int wait, int* slot, Timer* timer)
+{
+    int i = -1;
+
+    *slot = -1;
+    if (!publishFits(c, topic, message))
+        return BUFFER_OVERFLOW;
+    if (message->qos == QOS1 || message->qos == QOS2)
+    {
+        if ((i = reserveInflight(c, (message->qos == QOS1) ? INFLIGHT_WAIT_PUBACK : INFLIGHT_WAIT_PUBREC, wait, timer)) < 0)
+            return FAILURE;
+        message->id = c->inflight[i].id;
+        if (record != NULL)
+        {
+            c->inflight[i].record = *record;
+            record->seq = 0;
+        }
+        else if (c->persistence != NULL && logPublish(c, topic, message, &c->inflight[i].record) != SUCCESS)
+        {
+            c->inflight[i].state = INFLIGHT_FREE; /* nothing was sent, the slot is given back */
+            return PERSISTENCE_FAILURE;
+        }
+        if (!c->cleansession && !wait)
+            c->inflight[i].resend = copyMessage(topic, message);
+    }
+    *slot = i;
+    return writePublish(c, topic, message, 0, timer);
+}
+
+
+/* Called with the write lock held, on a new connection: the exchanges kept from the previous one go on
+ * if the broker has the session, sending again, oldest first, the publishes not acked and the PUBRELs
+ * of the ones received. Otherwise they fail. */
+static int resumeInflight(MQTTClient* c, unsigned char sessionPresent, Timer* timer)
+{
+    unsigned char pending[INFLIGHT_SLOTS];
+    int i, oldest, rc = SUCCESS;
+
+    for (i = 0; i < INFLIGHT_SLOTS; ++i)
+    {
+        pending[i] = isPublishState(c->inflight[i].state);
+        if (pending[i] && !sessionPresent)
+            completeInflight(c, i, FAILURE);
+    }
+    while (sessionPresent && rc == SUCCESS)
+    {
+        unsigned int age, oldest_age = 0;
+
+        oldest = -1;
+        for (i = 0; i < INFLIGHT_SLOTS; ++i)
+        {
+            age = (c->next_packetid + MAX_PACKET_ID - c->inflight[i].id) % MAX_PACKET_ID;
+            if (pending[i] && (oldest < 0 || age > oldest_age))
+            {
+                oldest = i;
+                oldest_age = age;
+            }
+        }
+        if (oldest < 0)
+            break;
+        pending[oldest] = 0;
+        if (c->inflight[oldest].state == INFLIGHT_WAIT_PUBCOMP)
+        {
+            int len = MQTTSerialize_ack(c->buf, c->buf_size, PUBREL, 0, c->inflight[oldest].id);
+            rc = (len > 0) ? sendPacket(c, len, timer) : FAILURE;
+        }
+        else
+        {
+            MQTTQueuedMessage* q = c->inflight[oldest].resend;
+            MQTTString topic = topicString(q->topicName);
+
+            q->message.id = c->inflight[oldest].id;
+            rc = writePublish(c, &topic, &q->message, 1, timer);
+        }
+    }
+    return rc;
+}
+
+
+static void discardQueueHead(MQTTClient* c)
+{
+    logDone(c, &c->queue_head->record);
+    removeQueued(c, c->queue_head);
+    c->queue_dropped++;
+}
+
+
+/* Called with the write lock held: copy a message published while offline at the end of the queue */
+static int enqueueMessage(MQTTClient* c, MQTTString* topic, MQTTMessage* message)
+{
+    size_t topic_len = topic->lenstring.len + 1;
+    size_t size = sizeof(MQTTQueuedMessage) + topic_len + message->payloadlen;
+    MQTTQueuedMessage* q;
+
+    message->id = 0;
+    if (size > c->queue_budget || !publishFits(c, topic, message))
+    {
+        c->queue_dropped++;
+        return BUFFER_OVERFLOW;
+    }
+    while (c->queue_bytes + size > c->queue_budget)
+    {
+        if (c->queue_policy == QUEUE_DROP_NEWEST)
+        {
+            c->queue_dropped++;
+            return BUFFER_OVERFLOW;
+        }
+        discardQueueHead(c);
+    }
+    if ((q = copyMessage(topic, message)) == NULL)
+        return FAILURE;
+    if (c->persistence != NULL && message->qos != QOS0 && logPublish(c, topic, &q->message, &q->record) != SUCCESS)
+    {
+        MQTTFree(q);
+        return PERSISTENCE_FAILURE;
+    }
+    appendQueued(c, q);
+    return SUCCESS;
+}
+
+
+/* Called with the write lock held: send the queued messages, oldest first, without waiting for their acks.
+ * A message leaves the queue once sent, or once an in-flight slot owns it even if the send failed: the slot
+ * resends it with the session, or queues it again from its log record. On failure the rest stays queued
+ * for the next connection, but a message that can't be serialized is discarded. */
+static int drainQueue(MQTTClient* c, Timer* timer)
+{
+    int rc = SUCCESS;
+    int i;
+
+    while (c->queue_head != NULL && rc == SUCCESS)
+    {
+        MQTTQueuedMessage* q = c->queue_head;
+        MQTTString topic = topicString(q->topicName);
+
+        rc = sendPublish(c, &topic, &q->message, &q->record, 0, &i, timer);
+        if (rc == BUFFER_OVERFLOW)
+        {
+            discardQueueHead(c); /* e.g. replayed from a log written with a bigger buffer: it can never be sent */
+            rc = SUCCESS;
+        }
+        else if (rc == SUCCESS || i >= 0)
+            removeQueued(c, q);
+    }
+    return rc;
+}
 
 
 int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTConnackData* data)
@@ -445,12 +2262,28 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
     if (options == 0)
         options = &default_options; /* set default options if none were supplied */
 
+    /* bytes buffered from a previous connection are meaningless now */
+    c->readbuf_start = c->readbuf_end = 0;
+    c->packet_len = 0;
+    c->stream_state = STREAM_IDLE;
+
+    lockWrite(c);
+    /* messages waiting for a manual ack can't be acked to the broker of a new connection, which sends them
+       again: no PUBREC was sent for the QoS2 ones, so they are not kept from being delivered again */
+    while (c->unacked_count > 0)
+    {
+        c->unacked_count--;
+        if (c->unacked_qos[c->unacked_count] == QOS2)
+            forgetInbound(c, c->unacked_ids[c->unacked_count]);
+    }
     c->keepAliveInterval = options->keepAliveInterval;
     c->cleansession = options->cleansession;
     TimerCountdown(&c->last_received, c->keepAliveInterval);
-    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &connect_timer)) != SUCCESS)  // send the connect packet
+    if ((len = MQTTSerialize_connect(c->buf, c->buf_size, options)) > 0 &&
+        (rc = sendPacket(c, len, &connect_timer)) == SUCCESS)  // send the connect packet
+        rc = flushWrites(c, &connect_timer);
+    unlockWrite(c);
+    if (len <= 0 || rc != SUCCESS)
         goto exit; // there was a problem
 
     // this will be a blocking call, wait for the connack
@@ -458,7 +2291,7 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
     {
         data->rc = 0;
         data->sessionPresent = 0;
-        if (MQTTDeserialize_connack(&data->sessionPresent, &data->rc, c->readbuf, c->readbuf_size) == 1){
+        if (MQTTDeserialize_connack(&data->sessionPresent, &data->rc, c->packet, c->packet_len) == 1){
             rc = data->rc;
         }else
             rc = FAILURE;
@@ -469,14 +2302,38 @@ int MQTTConnectWithResults(MQTTClient* c, MQTTPacket_connectData* options, MQTTC
 exit:
     if (rc == SUCCESS)
     {
+        if (!data->sessionPresent)
+            c->inbound_qos2_count = 0; /* no PUBREL will come for the messages of the old session */
+        lockWrite(c);
         c->isconnected = 1;
         c->ping_outstanding = 0;
+        TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+        if (resumeInflight(c, data->sessionPresent, &connect_timer) != SUCCESS ||
+            flushWrites(c, &connect_timer) != SUCCESS)
+        {
+            MQTTCloseSession(c);
+            rc = FAILURE;
+        }
+        unlockWrite(c);
     }
 
 #if defined(MQTT_TASK)
-	  MutexUnlock(&c->mutex);
+	  MQTTReleaseReader(c);
 #endif
 
+    if (rc == SUCCESS && c->queue_head != NULL)
+    {
+        // send what was published while offline, the acks are read by the next cycles
+        lockWrite(c);
+        TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+        if (drainQueue(c, &connect_timer) != SUCCESS || flushWrites(c, &connect_timer) != SUCCESS)
+        {
+            MQTTCloseSession(c);
+            rc = FAILURE;
+        }
+        unlockWrite(c);
+    }
+
     return rc;
 }
 
@@ -488,96 +2345,198 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
 }
 
 
-int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler)
+/* called with the write lock held, returns the link to the handler of topicFilter, NULL if there is none */
+static struct MessageHandlers** findMessageHandler(MQTTClient* c, const char* topicFilter)
+{
+    struct TopicNodes* node;
+    struct MessageHandlers** link;
+
+    if ((node = topicFilterNode(c, topicFilter, 0)) == NULL)
+        return NULL;
+    for (link = &node->handlers; *link != NULL; link = &(*link)->next)
+    {
+        if (strcmp((*link)->topicFilter, topicFilter) == 0)
+            return link;
+    }
+    return NULL;
+}
+
+
+/* called with the write lock held */
+static int setMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler, int id)
 {
     int rc = FAILURE;
-    int i = -1;
+    struct TopicNodes* node;
+    struct MessageHandlers *h = NULL, **link;
 
-    /* first check for an existing matching slot */
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    /* first check for an existing matching handler */
+    if ((link = findMessageHandler(c, topicFilter)) != NULL)
+        h = *link;
+    if (h != NULL)
     {
-        if (c->messageHandlers[i].topicFilter != NULL && strcmp(c->messageHandlers[i].topicFilter, topicFilter) == 0)
+        if (messageHandler == NULL) /* remove existing */
         {
-            if (messageHandler == NULL) /* remove existing */
-            {
-                c->messageHandlers[i].topicFilter = NULL;
-                c->messageHandlers[i].fp = NULL;
-            }
-            rc = SUCCESS; /* return i when adding new subscription */
-            break;
+            *link = h->next;
+            releaseTopicNodes(c, h->node);
+            MQTTFree(h->topicFilter);
+            poolFree(&c->handlersPool, h);
         }
-    }
-    /* if no existing, look for empty slot (unless we are removing) */
-    if (messageHandler != NULL) {
-        if (rc == FAILURE)
+        else
         {
-            for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-            {
-                if (c->messageHandlers[i].topicFilter == NULL)
-                {
-                    rc = SUCCESS;
-                    break;
-                }
-            }
+            h->fp = messageHandler;
+            h->id = id;
         }
-        if (i < MAX_MESSAGE_HANDLERS)
+        rc = SUCCESS;
+    }
+    /* if no existing, add a new one from the pool (unless we are removing) */
+    else if (messageHandler != NULL)
+    {
+        if ((h = poolAlloc(&c->handlersPool)) == NULL)
+            goto exit;
+        if ((h->topicFilter = MQTTMalloc(strlen(topicFilter) + 1)) == NULL ||
+            (node = topicFilterNode(c, topicFilter, 1)) == NULL)
         {
-            c->messageHandlers[i].topicFilter = topicFilter;
-            c->messageHandlers[i].fp = messageHandler;
+            if (h->topicFilter != NULL)
+                MQTTFree(h->topicFilter);
+            poolFree(&c->handlersPool, h);
+            goto exit;
         }
+        strcpy(h->topicFilter, topicFilter);
+        h->fp = messageHandler;
+        h->id = id;
+        h->node = node;
+        h->next = node->handlers;
+        node->handlers = h;
+        rc = SUCCESS;
     }
+exit:
     return rc;
 }
 
 
-int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qos,
-       messageHandler messageHandler, MQTTSubackData* data)
+int MQTTSetMessageHandler(MQTTClient* c, const char* topicFilter, messageHandler messageHandler)
+{
+    int rc;
+
+    lockWrite(c);
+    rc = setMessageHandler(c, topicFilter, messageHandler, -1);
+    unlockWrite(c);
+    return rc;
+}
+
+
+/* the handler a filter had before MQTTSubscribeMany, fp is NULL if it had none */
+struct PreviousHandler
+{
+    messageHandler fp;
+    int id;
+};
+
+
+int MQTTSubscribeMany(MQTTClient* c, int count, const char* topicFilters[], enum QoS qos[],
+       messageHandler messageHandler, int ids[], int grantedQoSs[])
 {
     int rc = FAILURE;
     Timer timer;
     int len = 0;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
+    int i = -1, k, added = 0;
+    int keep_connection = 0;
+    MQTTString* topics = NULL;
+    struct PreviousHandler* previous;
+    char* requestedQoSs;
 
-#if defined(MQTT_TASK)
-	  MutexLock(&c->mutex);
-#endif
+    lockWrite(c);
 	  if (!c->isconnected)
 		    goto exit;
 
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic, (char*)&qos);
-    if (len <= 0)
+    keep_connection = 1;
+    if ((topics = MQTTMalloc(count * (sizeof(MQTTString) + sizeof(struct PreviousHandler) + 1))) == NULL)
+        goto exit;
+    previous = (struct PreviousHandler*)(topics + count);
+    requestedQoSs = (char*)(previous + count);
+    for (k = 0; k < count; ++k)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char *)topicFilters[k];
+        topics[k] = topic;
+        requestedQoSs[k] = qos[k];
+    }
+
+    keep_connection = 0;
+    if ((i = reserveInflight(c, INFLIGHT_WAIT_SUBACK, 1, &timer)) < 0)
         goto exit;
+
+    /* the handlers are in place before the broker can send retained messages */
+    for (added = 0; added < count; ++added)
+    {
+        struct MessageHandlers** link = findMessageHandler(c, topicFilters[added]);
+
+        /* filters subscribed before this call get their previous handler back on failure */
+        previous[added].fp = (link != NULL) ? (*link)->fp : NULL;
+        previous[added].id = (link != NULL) ? (*link)->id : -1;
+        if (setMessageHandler(c, topicFilters[added], messageHandler, (ids != NULL) ? ids[added] : -1) != SUCCESS)
+            break;
+    }
+    if (added < count ||
+        (len = MQTTSerialize_subscribe(c->buf, c->buf_size, 0, c->inflight[i].id, count, topics, requestedQoSs)) <= 0)
+    {
+        keep_connection = 1; /* no room for the handlers or the packet, the connection is still fine */
+        goto exit;
+    }
+    c->inflight[i].granted = grantedQoSs;
+    c->inflight[i].count = count;
     if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
         goto exit;             // there was a problem
 
-    if (waitfor(c, SUBACK, &timer) == SUBACK)      // wait for suback
+    rc = waitforInflight(c, i, &timer);      // wait for suback
+    i = -1;
+    if (rc == SUCCESS)
     {
-        int count = 0;
-        unsigned short mypacketid;
-        data->grantedQoS = QOS0;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, (int*)&data->grantedQoS, c->readbuf, c->readbuf_size) == 1)
+        for (k = 0; k < count; ++k)
         {
-            if (data->grantedQoS != 0x80)
-                rc = MQTTSetMessageHandler(c, topicFilter, messageHandler);
+            if (grantedQoSs[k] == SUBFAIL)
+                setMessageHandler(c, topicFilters[k], previous[k].fp, previous[k].id);
         }
     }
-    else
-        rc = FAILURE;
 
 exit:
     if (rc == FAILURE)
-        MQTTCloseSession(c);
-#if defined(MQTT_TASK)
-	  MutexUnlock(&c->mutex);
-#endif
+    {
+        if (i >= 0)
+            c->inflight[i].state = INFLIGHT_FREE;
+        for (k = added - 1; k >= 0; --k) /* backwards, for filters repeated in the call */
+            setMessageHandler(c, topicFilters[k], previous[k].fp, previous[k].id);
+        if (!keep_connection)
+            MQTTCloseSession(c);
+    }
+    if (topics != NULL)
+        MQTTFree(topics);
+    unlockWrite(c);
     return rc;
 }
 
 
+int MQTTSubscribeWithId(MQTTClient* c, const char* topicFilter, enum QoS qos,
+       messageHandler messageHandler, int id, MQTTSubackData* data)
+{
+    int rc, grantedQoS = QOS0;
+
+    rc = MQTTSubscribeMany(c, 1, &topicFilter, &qos, messageHandler, &id, &grantedQoS);
+    data->grantedQoS = (enum QoS)grantedQoS;
+    return rc;
+}
+
+
+int MQTTSubscribeWithResults(MQTTClient* c, const char* topicFilter, enum QoS qos,
+       messageHandler messageHandler, MQTTSubackData* data)
+{
+    return MQTTSubscribeWithId(c, topicFilter, qos, messageHandler, -1, data);
+}
+
+
 int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos,
        messageHandler messageHandler)
 {
@@ -586,131 +2545,419 @@ int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos,
 }
 
 
-int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
+int MQTTUnsubscribeMany(MQTTClient* c, int count, const char* topicFilters[])
 {
     int rc = FAILURE;
     Timer timer;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicFilter;
     int len = 0;
+    int i = -1, k;
+    int keep_connection = 0;
+    MQTTString* topics = NULL;
 
-#if defined(MQTT_TASK)
-	  MutexLock(&c->mutex);
-#endif
+    lockWrite(c);
 	  if (!c->isconnected)
 		  goto exit;
 
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
-    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, getNextPacketId(c), 1, &topic)) <= 0)
+    keep_connection = 1;
+    if ((topics = MQTTMalloc(count * sizeof(MQTTString))) == NULL)
         goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
+    for (k = 0; k < count; ++k)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char *)topicFilters[k];
+        topics[k] = topic;
+    }
+
+    keep_connection = 0;
+    if ((i = reserveInflight(c, INFLIGHT_WAIT_UNSUBACK, 1, &timer)) < 0)
+        goto exit;
+    if ((len = MQTTSerialize_unsubscribe(c->buf, c->buf_size, 0, c->inflight[i].id, count, topics)) <= 0)
+    {
+        keep_connection = 1; /* no room for the packet, the connection is still fine */
+        goto exit;
+    }
+    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the unsubscribe packet
         goto exit; // there was a problem
 
-    if (waitfor(c, UNSUBACK, &timer) == UNSUBACK)
+    rc = waitforInflight(c, i, &timer);
+    i = -1;
+    if (rc == SUCCESS)
     {
-        unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, c->readbuf, c->readbuf_size) == 1)
-        {
-            /* remove the subscription message handler associated with this topic, if there is one */
-            MQTTSetMessageHandler(c, topicFilter, NULL);
-        }
+        /* remove the subscription message handlers associated with these topics, if there are any */
+        for (k = 0; k < count; ++k)
+            setMessageHandler(c, topicFilters[k], NULL, -1);
     }
-    else
-        rc = FAILURE;
 
 exit:
     if (rc == FAILURE)
-        MQTTCloseSession(c);
-#if defined(MQTT_TASK)
-	  MutexUnlock(&c->mutex);
-#endif
+    {
+        if (i >= 0)
+            c->inflight[i].state = INFLIGHT_FREE;
+        if (!keep_connection)
+            MQTTCloseSession(c);
+    }
+    if (topics != NULL)
+        MQTTFree(topics);
+    unlockWrite(c);
     return rc;
 }
 
 
-int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+int MQTTUnsubscribe(MQTTClient* c, const char* topicFilter)
+{
+    return MQTTUnsubscribeMany(c, 1, &topicFilter);
+}
+
+
+int MQTTSetPublishHandler(MQTTClient* c, publishHandler publishHandler)
+{
+    lockWrite(c);
+    c->publishCompleteHandler = publishHandler;
+    unlockWrite(c);
+    return SUCCESS;
+}
+
+
+int MQTTSetStreamHandler(MQTTClient* c, streamHandler streamHandler, size_t chunk)
+{
+    if (chunk == 0 || chunk > c->readbuf_size)
+        chunk = c->readbuf_size;
+    c->stream_chunk = chunk;
+    c->streamHandler = streamHandler;
+    return SUCCESS;
+}
+
+
+int MQTTSetInflightWindow(MQTTClient* c, unsigned int window)
+{
+    if (window < 1)
+        window = 1;
+    else if (window > MAX_INFLIGHT_MESSAGES)
+        window = MAX_INFLIGHT_MESSAGES;
+    c->inflight_window = window;
+    return SUCCESS;
+}
+
+
+int MQTTSetManualAck(MQTTClient* c, unsigned int window)
+{
+    if (window > MAX_UNACKED_INBOUND)
+        window = MAX_UNACKED_INBOUND;
+    lockWrite(c);
+    c->ack_window = window;
+    notifyWaiters(c); /* a larger window lets the reading side go on */
+    unlockWrite(c);
+    return SUCCESS;
+}
+
+
+int MQTTAck(MQTTClient* c, unsigned short packetid)
 {
     int rc = FAILURE;
+    unsigned int i;
+    int len;
     Timer timer;
-    MQTTString topic = MQTTString_initializer;
-    topic.cstring = (char *)topicName;
-    int len = 0;
 
-#if defined(MQTT_TASK)
-	  MutexLock(&c->mutex);
-#endif
-	  if (!c->isconnected)
-		    goto exit;
+    lockWrite(c);
+    for (i = 0; i < c->unacked_count; ++i)
+    {
+        if (c->unacked_ids[i] == packetid)
+            break;
+    }
+    if (i == c->unacked_count || !c->isconnected)
+        goto exit;
 
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
+    len = MQTTSerialize_ack(c->buf, c->buf_size, (c->unacked_qos[i] == QOS1) ? PUBACK : PUBREC, 0, packetid);
+    c->unacked_count--;
+    memmove(&c->unacked_ids[i], &c->unacked_ids[i + 1], (c->unacked_count - i) * sizeof(c->unacked_ids[0]));
+    memmove(&c->unacked_qos[i], &c->unacked_qos[i + 1], (c->unacked_count - i) * sizeof(c->unacked_qos[0]));
+    if (len > 0 && (rc = sendPacket(c, len, &timer)) != SUCCESS)
+        MQTTCloseSession(c);
+    notifyWaiters(c); /* the reading side can take the next message */
+exit:
+    unlockWrite(c);
+    return rc;
+}
 
-    if (message->qos == QOS1 || message->qos == QOS2)
-        message->id = getNextPacketId(c);
 
-    len = MQTTSerialize_publish(c->buf, c->buf_size, 0, message->qos, message->retained, message->id,
-              topic, (unsigned char*)message->payload, message->payloadlen);
-    if (len <= 0)
-        goto exit;
-    if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
-        goto exit; // there was a problem
+int MQTTPauseReceive(MQTTClient* c, int pause)
+{
+    lockWrite(c);
+    c->receive_paused = (pause != 0);
+    if (!pause)
+        notifyWaiters(c); /* the reading side can take the next message */
+    unlockWrite(c);
+    return SUCCESS;
+}
+
 
-    if (message->qos == QOS1)
+/* Find the committed log of the latest generation, -1 if there is none */
+static int findLog(MQTTClient* c, unsigned int* generation)
+{
+    int log, found = -1;
+
+    for (log = 0; log < 2; ++log)
     {
-        if (waitfor(c, PUBACK, &timer) == PUBACK)
+        unsigned char type, body[4];
+        size_t len, offset, record_len;
+        unsigned int gen;
+
+        if ((offset = readLogRecord(c, log, 0, &type, &len, body, sizeof(body))) == 0 || type != LOG_BEGIN ||
+            len != sizeof(body))
+            continue;
+        gen = readLogInt(body);
+        while ((record_len = readLogRecord(c, log, offset, &type, &len, NULL, 0)) > 0 && type != LOG_COMMIT)
+            offset += record_len;
+        if (record_len > 0 && (found < 0 || (int)(gen - *generation) > 0))
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
+            found = log;
+            *generation = gen;
         }
-        else
-            rc = FAILURE;
     }
-    else if (message->qos == QOS2)
+    return found;
+}
+
+
+/* Queue the messages of the log that were not acked, in the order they were published */
+static void replayLog(MQTTClient* c, int log)
+{
+    unsigned char type, body[4];
+    size_t len, offset, record_len;
+    MQTTQueuedMessage* q;
+
+    offset = readLogRecord(c, log, 0, &type, &len, body, sizeof(body));
+    while ((record_len = readLogRecord(c, log, offset, &type, &len, body, sizeof(body))) > 0)
     {
-        if (waitfor(c, PUBCOMP, &timer) == PUBCOMP)
+        if (type == LOG_PUBLISH && (q = loadLogRecord(c, log, offset)) != NULL)
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
+            appendQueued(c, q);
+            c->log_live += q->record.len;
+            if ((int)(q->record.seq - c->log_seq) > 0)
+                c->log_seq = q->record.seq;
         }
-        else
-            rc = FAILURE;
+        else if (type == LOG_DONE && len == sizeof(body))
+        {
+            unsigned int seq = readLogInt(body);
+
+            for (q = c->queue_head; q != NULL && q->record.seq != seq; q = q->next)
+                ;
+            if (q != NULL)
+            {
+                c->log_live -= q->record.len;
+                removeQueued(c, q);
+            }
+        }
+        offset += record_len;
+    }
+    c->log_size = offset;
+}
+
+
+int MQTTSetPersistence(MQTTClient* c, MQTTPersistence* persistence)
+{
+    int rc = SUCCESS;
+    int i, log;
+    unsigned int generation = 0;
+    MQTTQueuedMessage* q;
+
+    lockWrite(c);
+    if (c->persistence != NULL)
+    {
+        /* the records of the messages are in the old storage */
+        flushLog(c);
+        for (i = 0; i < INFLIGHT_SLOTS; ++i)
+            c->inflight[i].record.seq = 0;
+        for (q = c->queue_head; q != NULL; q = q->next)
+            q->record.seq = 0;
+        MQTTFree(c->log_buf);
+        c->log_buf = NULL;
+        c->persistence = NULL;
+    }
+    if (persistence == NULL)
+        goto exit;
+    if ((c->log_buf = MQTTMalloc(2 * PERSISTENCE_BUFFER)) == NULL)
+    {
+        rc = FAILURE;
+        goto exit;
+    }
+    c->persistence = persistence;
+    c->log_buffered = 0;
+    c->log_live = 0;
+    c->log_seq = 0;
+    if ((log = findLog(c, &generation)) >= 0)
+    {
+        c->log_index = log;
+        c->log_generation = generation;
+        replayLog(c, log);
+    }
+    else
+    {
+        /* nothing to recover, the first log is started by the compaction below */
+        c->log_index = 1;
+        c->log_generation = 0;
+        c->log_size = 0;
+        persistence->erase(persistence->context, 1);
     }
+    /* go on from a log with only the records still needed, leaving any torn tail behind */
+    rc = compactLog(c);
 
 exit:
-    if (rc == FAILURE)
+    unlockWrite(c);
+    return rc;
+}
+
+
+int MQTTFlush(MQTTClient* c)
+{
+    int rc;
+    Timer timer;
+
+    lockWrite(c);
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    if ((rc = flushWrites(c, &timer)) != SUCCESS)
         MQTTCloseSession(c);
-#if defined(MQTT_TASK)
-	  MutexUnlock(&c->mutex);
-#endif
+    unlockWrite(c);
+    return rc;
+}
+
+
+int MQTTSetWriteBuffer(MQTTClient* c, unsigned char* buf, size_t size, unsigned int delay_ms)
+{
+    int rc;
+    Timer timer;
+
+    if (buf != NULL && delay_ms == 0)
+        return FAILURE; /* the reading task would never block */
+    lockWrite(c);
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+    if ((rc = flushWrites(c, &timer)) != SUCCESS)
+        MQTTCloseSession(c);
+    c->wbuf = buf;
+    c->wbuf_size = size;
+    c->wbuf_len = 0;
+    c->wbuf_delay_ms = delay_ms;
+    unlockWrite(c);
+    return rc;
+}
+
+
+int MQTTSetOfflineQueue(MQTTClient* c, size_t budget, enum queuePolicy policy)
+{
+    lockWrite(c);
+    c->queue_budget = budget;
+    c->queue_policy = policy;
+    while (c->queue_bytes > c->queue_budget)
+        discardQueueHead(c);
+    unlockWrite(c);
+    return SUCCESS;
+}
+
+
+static int publish(MQTTClient* c, MQTTString* topic, MQTTMessage* message, int wait)
+{
+    int rc = FAILURE;
+    Timer timer;
+    int i = -1;
+
+    lockWrite(c);
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    // messages queued while offline go first
+    if (c->isconnected && c->queue_head != NULL && drainQueue(c, &timer) != SUCCESS)
+        MQTTCloseSession(c);
+    if (!c->isconnected && c->queue_budget > 0)
+    {
+        rc = enqueueMessage(c, topic, message);
+        unlockWrite(c);
+        return rc;
+    }
+	  if (!c->isconnected)
+		    goto exit;
+
+    if (c->persistence != NULL && message->qos != QOS0 && logNeedsCompaction(c))
+        compactLog(c); /* by the publishing task, rather than by the reading one when the acks come */
+    if ((rc = sendPublish(c, topic, message, NULL, wait, &i, &timer)) != SUCCESS) // send the publish packet
+    {
+        if (i >= 0 && !wait)
+        {
+            /* the slot owns the message: it is resent with the session or fails through the publish handler */
+            MQTTCloseSession(c);
+            rc = SUCCESS;
+        }
+        goto exit; // there was a problem
+    }
+
+    if (i >= 0 && wait)
+    {
+        // other acks are handled on the way by whichever task is reading
+        rc = waitforInflight(c, i, &timer);
+    }
+
+exit:
+    if (rc == FAILURE || rc == REQUEUED)
+    {
+        MQTTCloseSession(c);
+        if (i >= 0 && wait && c->inflight[i].state == INFLIGHT_DONE)
+            c->inflight[i].state = INFLIGHT_FREE;
+    }
+    unlockWrite(c);
     return rc;
 }
 
 
+int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    MQTTString topic = topicString(topicName);
+
+    return publish(c, &topic, message, 1);
+}
+
+
+int MQTTPublishAsync(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    MQTTString topic = topicString(topicName);
+
+    return publish(c, &topic, message, 0);
+}
+
+
+int MQTTPublishTopic(MQTTClient* c, MQTTString* topic, MQTTMessage* message)
+{
+    return publish(c, topic, message, 1);
+}
+
+
+int MQTTPublishTopicAsync(MQTTClient* c, MQTTString* topic, MQTTMessage* message)
+{
+    return publish(c, topic, message, 0);
+}
+
+
 int MQTTDisconnect(MQTTClient* c)
 {
     int rc = FAILURE;
     Timer timer;     // we might wait for incomplete incoming publishes to complete
     int len = 0;
 
-#if defined(MQTT_TASK)
-	MutexLock(&c->mutex);
-#endif
+    lockWrite(c);
     TimerInit(&timer);
     TimerCountdownMS(&timer, c->command_timeout_ms);
 
 	  len = MQTTSerialize_disconnect(c->buf, c->buf_size);
-    if (len > 0)
-        rc = sendPacket(c, len, &timer);            // send the disconnect packet
+    if (len > 0 && (rc = sendPacket(c, len, &timer)) == SUCCESS)            // send the disconnect packet
+        rc = flushWrites(c, &timer);
     MQTTCloseSession(c);
+    if (c->persistence != NULL)
+        flushLog(c);
 
-#if defined(MQTT_TASK)
-	  MutexUnlock(&c->mutex);
-#endif
+    unlockWrite(c);
     return rc;
 }
@@ -48,13 +48,72 @@
 #define MAX_PACKET_ID 65535 /* according to the MQTT specification - do not change! */
 
 #if !defined(MAX_MESSAGE_HANDLERS)
-#define MAX_MESSAGE_HANDLERS 16 /* redefinable - how many subscriptions do you want? */
+#define MAX_MESSAGE_HANDLERS 16 /* redefinable - how many subscriptions fit before more memory is allocated? */
+#endif
+
+#if !defined(MAX_TOPIC_NODES)
+#define MAX_TOPIC_NODES (MAX_MESSAGE_HANDLERS * 4) /* redefinable - how many topic levels fit before more memory is allocated? */
+#endif
+
+#if !defined(MESSAGE_HANDLERS_SLAB)
+#define MESSAGE_HANDLERS_SLAB 16 /* redefinable - how many subscriptions are added to the pool at a time */
+#endif
+
+#if !defined(TOPIC_NODES_SLAB)
+#define TOPIC_NODES_SLAB 32 /* redefinable - how many topic levels are added to the pool at a time */
+#endif
+
+#if !defined(MQTTMalloc)
+#include <stdlib.h>
+#define MQTTMalloc malloc /* redefinable - the platform allocator, for pool slabs and topic filter copies */
+#define MQTTFree free
+#endif
+
+#if !defined(MAX_INFLIGHT_MESSAGES)
+#define MAX_INFLIGHT_MESSAGES 8 /* redefinable - how many QoS1/QoS2 publishes can wait for their acks at once? */
+#endif
+
+/* the in-flight table: a full publish window still leaves a slot to subscriptions */
+#define INFLIGHT_SLOTS (MAX_INFLIGHT_MESSAGES + 1)
+
+#if !defined(MAX_INBOUND_QOS2)
+#define MAX_INBOUND_QOS2 16 /* redefinable - how many received QoS2 messages can wait for their PUBREL? */
+#endif
+
+#if !defined(MAX_UNACKED_INBOUND)
+#define MAX_UNACKED_INBOUND 16 /* redefinable - how many received messages can wait for the application to ack them? */
+#endif
+
+#if !defined(HELD_READ_POLL_MS)
+#define HELD_READ_POLL_MS 100 /* redefinable - how often a reader held by a publish it can't take checks for the packets behind it */
+#endif
+
+#if !defined(PERSISTENCE_BUFFER)
+#define PERSISTENCE_BUFFER 256 /* redefinable - how many bytes of log records are batched before being written */
+#endif
+
+#if !defined(PERSISTENCE_COMPACT_SIZE)
+#define PERSISTENCE_COMPACT_SIZE 8192 /* redefinable - from what size a log mostly made of acked messages is compacted */
+#endif
+
+#if !defined(ACK_BUFFER)
+#define ACK_BUFFER 64 /* redefinable - how many bytes of acks to packets read in a row are written at once */
+#endif
+
+#if !defined(MAX_ACK_DELAY_MS)
+#define MAX_ACK_DELAY_MS 100 /* redefinable - how long an ack can wait for the following ones */
+#endif
+
+#if !defined(MAX_IDLE_WAIT_MS)
+#define MAX_IDLE_WAIT_MS 60000 /* redefinable - longest time the reading task blocks when no timed work is due */
 #endif
 
 enum QoS { QOS0, QOS1, QOS2, SUBFAIL=0x80 };
 
 /* all failure return codes must be negative */
-enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
+/* REQUEUED: the exchange of a persisted publish failed and the message is queued again from the log,
+ * to be sent and reported once more under a new packet id */
+enum returnCode { PERSISTENCE_FAILURE = -3, BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0, REQUEUED = 1 };
 
 /* The Platform specific header must define the Network and Timer structures and functions
  * which operate on them.
@@ -62,7 +121,9 @@ enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
 typedef struct Network
 {
 	int (*mqttread)(Network*, unsigned char* read_buffer, int, int);
+	int (*mqttrecv)(Network*, unsigned char* read_buffer, int, int);   reads what is available, up to len
 	int (*mqttwrite)(Network*, unsigned char* send_buffer, int, int);
+	int (*mqttwritev)(Network*, NetworkVector* buffers, int count, int);   optional, sends the buffers in sequence
 } Network;*/
 
 /* The Timer structure must be defined in the platform specific header,
@@ -87,6 +148,8 @@ typedef struct MessageData
 {
     MQTTMessage* message;
     MQTTString* topicName;
+    int* subscriptions;                           /* ids of the matching topic filters handled by this handler */
+    int subscription_count;
 } MessageData;
 
 typedef struct MQTTConnackData
@@ -102,14 +165,76 @@ typedef struct MQTTSubackData
 
 typedef void (*messageHandler)(MessageData*);
 
+typedef void (*publishHandler)(unsigned short packetid, int rc);
+
+/* PUBLISH packets bigger than the read buffer are handed to the stream handler in chunks:
+ * STREAM_BEGIN carries the topic, the matching subscriptions and the total payload length, each STREAM_DATA a piece of payload,
+ * STREAM_END the end of the message. A handler returning < 0 gets the same event again on the next cycle. */
+enum streamEvent { STREAM_BEGIN = 1, STREAM_DATA, STREAM_END };
+
+typedef int (*streamHandler)(int event, MessageData*);
+
+/* STREAM_SKIP_ACK skips a QoS1/QoS2 message that isn't delivered, e.g. a duplicate, and then sends its ack */
+enum streamState { STREAM_IDLE = 0, STREAM_DELIVER, STREAM_SKIP, STREAM_SKIP_ACK };
+
+/* what MQTTPublish does with a message made while offline when the queue budget is exhausted */
+enum queuePolicy { QUEUE_DROP_OLDEST = 0, QUEUE_DROP_NEWEST };
+
+enum inflightState { INFLIGHT_FREE = 0, INFLIGHT_WAIT_PUBACK, INFLIGHT_WAIT_PUBREC, INFLIGHT_WAIT_PUBCOMP,
+    INFLIGHT_WAIT_SUBACK, INFLIGHT_WAIT_UNSUBACK, INFLIGHT_DONE };
+
+/* Fixed size items handed out from slabs: the first slab is given at init, the next ones are allocated
+ * on demand and released once none of their items is in use. Free items are linked through their first
+ * field, which must be a pointer. */
+typedef struct MQTTPool
+{
+    void* free;
+    void* slabs;
+    size_t item_size;
+    unsigned int slab_items;
+} MQTTPool;
+
+/* Storage under the persistence log: two append-only logs, 0 and 1, taking turns across compactions.
+ * append, sync and erase return SUCCESS or FAILURE, read the number of bytes read, 0 past the end, < 0 on errors. */
+typedef struct MQTTPersistence
+{
+    void* context;
+    int (*append)(void* context, int log, const unsigned char* data, size_t len);
+    int (*read)(void* context, int log, size_t offset, unsigned char* data, size_t len);
+    int (*sync)(void* context, int log);          /* make the appended bytes durable */
+    int (*erase)(void* context, int log);
+} MQTTPersistence;
+
+/* Where a persisted publish is in the log */
+typedef struct MQTTLogRecord
+{
+    unsigned int seq;                             /* 0 if the message is not persisted */
+    size_t offset,
+      len;
+} MQTTLogRecord;
+
+/* A publish made while offline, copied in a single allocation: topic and payload follow the entry */
+typedef struct MQTTQueuedMessage
+{
+    struct MQTTQueuedMessage* next;
+    size_t size;                                  /* bytes charged to the queue budget */
+    char* topicName;
+    MQTTMessage message;
+    MQTTLogRecord record;
+} MQTTQueuedMessage;
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
       command_timeout_ms;
     size_t buf_size,
-      readbuf_size;
+      readbuf_size,
+      readbuf_start,                              /* bytes received but not handled yet are in readbuf[start:end] */
+      readbuf_end,
+      packet_len;
     unsigned char *buf,
-      *readbuf;
+      *readbuf,
+      *packet;                                    /* last packet read, parsed in place inside readbuf */
     unsigned int keepAliveInterval;
     char ping_outstanding;
     int isconnected;
@@ -117,22 +242,96 @@ typedef struct MQTTClient
 
     struct MessageHandlers
     {
-        const char* topicFilter;
+        struct MessageHandlers* next;             /* next handler ending on the same topic node, or next free one */
+        char* topicFilter;                        /* copy owned by the client */
         void (*fp) (MessageData*);
-    } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
+        int id;                                   /* subscription id given to MQTTSubscribeWithId, -1 if none */
+        struct TopicNodes* node;
+    } messageHandlers[MAX_MESSAGE_HANDLERS];      /* first slab of the handlers pool */
+
+    struct TopicNodes
+    {
+        struct TopicNodes* next;                  /* next node in the same hash bucket, or next free one */
+        struct TopicNodes* parent;                /* NULL on the first level */
+        unsigned int key;                         /* hash of the level */
+        char* level;                              /* copy of the level, owned by the client */
+        unsigned int level_len;
+        unsigned int refs;                        /* number of topic filters going through the node */
+        struct MessageHandlers* handlers;         /* topic filters ending on the node */
+    } topicNodes[MAX_TOPIC_NODES];                /* first slab of the topic nodes pool */
+    struct TopicNodes* topicBucketsInit[MAX_TOPIC_NODES];
+    struct TopicNodes** topicBuckets;             /* topic nodes, hashed by parent and level */
+    unsigned int topic_buckets_size,
+      topic_nodes_count;
+    MQTTPool handlersPool, topicNodesPool;
 
     void (*defaultMessageHandler) (MessageData*);
 
+    struct InflightMessages
+    {
+        unsigned short id;
+        unsigned char state;
+        unsigned char waiting;                    /* a task is blocked on this exchange and releases the slot */
+        int rc;                                   /* outcome once INFLIGHT_DONE: SUCCESS, FAILURE or REQUEUED */
+        int* granted;                             /* SUBSCRIBE only: where the granted QoS of each topic filter go */
+        int count;
+        MQTTLogRecord record;                     /* PUBLISH only: the copy kept by the persistence log */
+        MQTTQueuedMessage* resend;                /* PUBLISH only: the copy sent again if the session is resumed */
+    } inflight[INFLIGHT_SLOTS];                   /* exchanges waiting for acks, indexed by packet id */
+    unsigned int inflight_window;
+
+    void (*publishCompleteHandler) (unsigned short, int);
+
+    MQTTQueuedMessage *queue_head,                /* publishes waiting for a connection, oldest first */
+      *queue_tail;
+    size_t queue_budget,
+      queue_bytes;
+    unsigned int queue_count,
+      queue_dropped;                              /* messages discarded by the queue policy */
+    unsigned char queue_policy;
+
+    MQTTPersistence* persistence;
+    unsigned int log_generation,
+      log_seq;                                    /* last sequence number given to a persisted publish */
+    unsigned char log_index;                      /* log being appended to */
+    size_t log_size,                              /* bytes appended to the log, buffered ones included */
+      log_live,                                   /* bytes of the records of messages not acked yet */
+      log_buffered;
+    unsigned char* log_buf;                       /* records batched before being appended, then the buffer records are copied through */
+
+    int (*streamHandler) (int, MessageData*);
+    size_t stream_chunk,
+      stream_left;                                /* bytes of an oversized packet still to be streamed or skipped */
+    unsigned char stream_state;
+    MQTTMessage stream_msg;
+
+    unsigned short inbound_qos2[MAX_INBOUND_QOS2]; /* ids of the QoS2 messages delivered and not released, oldest first */
+    unsigned int inbound_qos2_count;
+
+    unsigned int ack_window;                      /* manual acks: how many messages can wait for MQTTAck, 0 acks at once */
+    unsigned short unacked_ids[MAX_UNACKED_INBOUND]; /* received messages waiting for MQTTAck */
+    unsigned char unacked_qos[MAX_UNACKED_INBOUND];
+    unsigned int unacked_count;
+    unsigned char receive_paused;                 /* received messages are left unread, see MQTTPauseReceive */
+
+    unsigned char* wbuf;                          /* small packets gathered to be written at once, NULL writes each */
+    size_t wbuf_size,
+      wbuf_len;                                   /* bytes gathered, in ackbuf when there is no wbuf */
+    unsigned int wbuf_delay_ms;
+    Timer wbuf_timer;                             /* started by the first packet gathered */
+    unsigned char ackbuf[ACK_BUFFER];             /* acks gathered without a write buffer */
+
     Network* ipstack;
     Timer last_sent, last_received, ping_resp;
 #if defined(MQTT_TASK)
-    Mutex mutex;
+    Mutex mutex;                                  /* held by the task reading the network */
+    Mutex write_mutex;                            /* held to send packets and to update the in-flight table */
+    Semaphore ack_sem;                            /* posted by the reading task when exchanges complete */
+    unsigned int ack_waiters;
     Thread thread;
 #endif
 } MQTTClient;
 
-#define DefaultClient {0, 0, 0, 0, NULL, NULL, 0, 0, 0}
-
 
 /**
  * Create an MQTT client object
@@ -145,7 +344,10 @@ DLLExport void MQTTClientInit(MQTTClient* client, Network* network, unsigned int
 		unsigned char* sendbuf, size_t sendbuf_size, unsigned char* readbuf, size_t readbuf_size);
 
 /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
- *  The nework object must be connected to the network endpoint before calling this
+ *  The nework object must be connected to the network endpoint before calling this.
+ *  Without a clean session, QoS1/QoS2 publishes not waited for survive a lost connection: when the
+ *  broker reports the session present they are sent again, with DUP set, or their PUBREL is, otherwise
+ *  they complete with FAILURE.
  *  @param options - connect options
  *  @return success code
  */
@@ -163,13 +365,139 @@ DLLExport int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
  *  @param client - the client object to use
  *  @param topic - the topic to publish to
  *  @param message - the message to send
- *  @return success code
+ *  @return success code, BUFFER_OVERFLOW with the connection kept for a message that can't be serialized
+ *  in the send buffer (the whole packet, or its header with mqttwritev)
  */
 DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
 
+/** MQTT Publish Async - send an MQTT publish packet without waiting for its acks.
+ *  QoS1/QoS2 messages are kept in the in-flight table until acknowledged, the call only blocks
+ *  when the in-flight window is full. Completion is reported to the publish handler, if any.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to
+ *  @param message - the message to send, message->id is set to the assigned packet id
+ *  @return success code
+ */
+DLLExport int MQTTPublishAsync(MQTTClient* client, const char*, MQTTMessage*);
+
+/** MQTT Publish Topic - MQTTPublish to a topic given in its lenstring form, e.g. prepared once for
+ *  many messages: the topic name is not measured again on every publish.
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to, lenstring.data must be zero terminated
+ *  @param message - the message to send
+ *  @return success code
+ */
+DLLExport int MQTTPublishTopic(MQTTClient* client, MQTTString* topic, MQTTMessage*);
+
+/** MQTT Publish Topic Async - MQTTPublishAsync to a topic given in its lenstring form
+ *  @param client - the client object to use
+ *  @param topic - the topic to publish to, lenstring.data must be zero terminated
+ *  @param message - the message to send, message->id is set to the assigned packet id
+ *  @return success code
+ */
+DLLExport int MQTTPublishTopicAsync(MQTTClient* client, MQTTString* topic, MQTTMessage*);
+
+/** MQTT SetPublishHandler - set or remove the handler called when a QoS1/QoS2 publish completes, with
+ *  SUCCESS, FAILURE or, for a persisted message queued again, REQUEUED (see MQTTSetPersistence)
+ *  @param client - the client object to use
+ *  @param publishHandler - pointer to the handler function or NULL to remove
+ *  @return success code
+ */
+DLLExport int MQTTSetPublishHandler(MQTTClient* c, publishHandler publishHandler);
+
+/** MQTT SetInflightWindow - set how many QoS1/QoS2 publishes can be unacknowledged at once
+ *  @param client - the client object to use
+ *  @param window - the window size, clamped to 1..MAX_INFLIGHT_MESSAGES
+ *  @return success code
+ */
+DLLExport int MQTTSetInflightWindow(MQTTClient* c, unsigned int window);
+
+/** MQTT SetManualAck - let the application ack received QoS1/QoS2 messages with MQTTAck, once it is done with
+ *  them, instead of acking them as soon as they are read. When window messages wait for their ack, the next
+ *  QoS1/QoS2 publish is left unread, and so are the publishes behind it, until the application acks one: the
+ *  broker is held back instead of messages being lost. Acks, subscription results and ping responses that fit in
+ *  the read buffer behind it are still handled. The broker sending a waiting message again gets no answer, the ack
+ *  of the application answers it. Messages still waiting are forgotten when the connection is lost: the broker
+ *  sends them again on the next one, QoS2 ones included, and they are delivered again.
+ *  @param client - the client object to use
+ *  @param window - how many messages can wait for their ack, clamped to MAX_UNACKED_INBOUND, 0 acks messages at once
+ *  @return success code
+ */
+DLLExport int MQTTSetManualAck(MQTTClient* c, unsigned int window);
+
+/** MQTT Ack - with manual acks, send the PUBACK or PUBREC of a received message
+ *  @param client - the client object to use
+ *  @param packetid - the id of the message, as given to the message handler
+ *  @return success code, FAILURE if the message doesn't wait for an ack, e.g. when the connection was lost since
+ */
+DLLExport int MQTTAck(MQTTClient* c, unsigned short packetid);
+
+/** MQTT PauseReceive - stop reading received publishes, e.g. while the consumer of the message handlers is busy:
+ *  the next publish is left unread, and so are the publishes the broker sends behind it, so that TCP flow control
+ *  holds the broker back instead of messages being dropped. Can be called from a message handler.
+ *  Other packets, before the next publish or behind it in the read buffer, are still handled.
+ *  @param client - the client object to use
+ *  @param pause - 1 to pause, 0 to resume, waking the task waiting to read
+ *  @return success code
+ */
+DLLExport int MQTTPauseReceive(MQTTClient* c, int pause);
+
+/** MQTT SetOfflineQueue - keep the messages published while disconnected, to send them on the next connection.
+ *  Queued messages are sent, oldest first, as soon as the client connects again and before any newer publish;
+ *  their QoS1/QoS2 completion is reported to the publish handler. When the budget is exhausted the oldest
+ *  queued messages are discarded to make room; with QUEUE_DROP_NEWEST the new message is discarded instead
+ *  and MQTTPublish returns BUFFER_OVERFLOW.
+ *  @param client - the client object to use
+ *  @param budget - the bytes the queued messages can use, 0 disables the queue and discards its content
+ *  @param policy - QUEUE_DROP_OLDEST or QUEUE_DROP_NEWEST
+ *  @return success code
+ */
+DLLExport int MQTTSetOfflineQueue(MQTTClient* c, size_t budget, enum queuePolicy policy);
+
+/** MQTT SetPersistence - keep QoS1/QoS2 publishes in a log until they are acked, so that they survive a restart.
+ *  Publishes still in the log, from a previous run, are queued to be sent on connection, oldest first.
+ *  Persisted messages whose exchange fails are queued again from the log, and complete with REQUEUED instead
+ *  of FAILURE, in MQTTPublish and in the publish handler: retrying them would send them twice. Records are batched in memory
+ *  and synced to storage when the client is idle, on a full batch buffer and on disconnection, and the log
+ *  is compacted by publishing tasks or when idle. A publish that can't be logged fails with PERSISTENCE_FAILURE, and is not sent.
+ *  Set it before connecting.
+ *  @param client - the client object to use
+ *  @param persistence - the storage of the log, or NULL to stop persisting
+ *  @return success code
+ */
+DLLExport int MQTTSetPersistence(MQTTClient* c, MQTTPersistence* persistence);
+
+/** MQTT SetWriteBuffer - gather small outgoing packets and write them together, with one network write
+ *  (one TLS record) instead of one each. Gathered packets are written when the buffer is full, delay_ms
+ *  after the first of them, before waiting for any answer from the broker and on MQTTFlush. The delay is
+ *  checked on every packet sent and by the reading task, which while the buffer is set blocks for at most
+ *  delay_ms at a time, so that packets gathered by other tasks meanwhile are not held longer.
+ *  @param client - the client object to use
+ *  @param buf - the buffer, or NULL to write every packet at once
+ *  @param size - the size of the buffer, bigger packets are written directly
+ *  @param delay_ms - how long a packet can wait for others, at least 1 with a buffer
+ *  @return success code, FAILURE without any change for a buffer with delay_ms 0
+ */
+DLLExport int MQTTSetWriteBuffer(MQTTClient* c, unsigned char* buf, size_t size, unsigned int delay_ms);
+
+/** MQTT Flush - write the packets gathered by the write buffer
+ *  @param client - the client object to use
+ *  @return success code
+ */
+DLLExport int MQTTFlush(MQTTClient* c);
+
+/** MQTT SetStreamHandler - set or remove the handler receiving PUBLISH packets bigger than the read buffer.
+ *  Without a stream handler such packets are skipped. Set it before connecting.
+ *  @param client - the client object to use
+ *  @param streamHandler - pointer to the handler function or NULL to remove
+ *  @param chunk - size of the STREAM_DATA payload pieces, at most the read buffer size
+ *  @return success code
+ */
+DLLExport int MQTTSetStreamHandler(MQTTClient* c, streamHandler streamHandler, size_t chunk);
+
 /** MQTT SetMessageHandler - set or remove a per topic message handler
  *  @param client - the client object to use
- *  @param topicFilter - the topic filter set the message handler for
+ *  @param topicFilter - the topic filter set the message handler for, the client keeps a copy
  *  @param messageHandler - pointer to the message handler function or NULL to remove
  *  @return success code
  */
@@ -192,6 +520,33 @@ DLLExport int MQTTSubscribe(MQTTClient* client, const char* topicFilter, enum Qo
  */
 DLLExport int MQTTSubscribeWithResults(MQTTClient* client, const char* topicFilter, enum QoS, messageHandler, MQTTSubackData* data);
 
+/** MQTT Subscribe - send an MQTT subscribe packet and wait for suback before returning.
+ *  A message matching several topic filters with the same handler calls it once, listing the ids
+ *  of all the matching filters in MessageData.subscriptions: callers can route messages without
+ *  matching topics again.
+ *  @param client - the client object to use
+ *  @param topicFilter - the topic filter to subscribe to
+ *  @param message - the message to send
+ *  @param id - the subscription id reported to the handler
+ *  @param data - suback granted QoS returned
+ *  @return success code
+ */
+DLLExport int MQTTSubscribeWithId(MQTTClient* client, const char* topicFilter, enum QoS, messageHandler, int id, MQTTSubackData* data);
+
+/** MQTT SubscribeMany - subscribe to several topic filters with a single subscribe packet, waiting for suback.
+ *  The topic filters whose subscription is refused (granted QoS SUBFAIL) get no message handler.
+ *  @param client - the client object to use
+ *  @param count - the number of topic filters
+ *  @param topicFilters - the topic filters to subscribe to
+ *  @param qos - the requested QoS of each topic filter
+ *  @param messageHandler - the message handler for all the topic filters
+ *  @param ids - the subscription id of each topic filter, reported to the handler, or NULL
+ *  @param grantedQoSs - returns the granted QoS of each topic filter
+ *  @return success code
+ */
+DLLExport int MQTTSubscribeMany(MQTTClient* client, int count, const char* topicFilters[], enum QoS qos[],
+    messageHandler, int ids[], int grantedQoSs[]);
+
 /** MQTT Subscribe - send an MQTT unsubscribe packet and wait for unsuback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to unsubscribe from
@@ -199,6 +554,14 @@ DLLExport int MQTTSubscribeWithResults(MQTTClient* client, const char* topicFilt
  */
 DLLExport int MQTTUnsubscribe(MQTTClient* client, const char* topicFilter);
 
+/** MQTT UnsubscribeMany - unsubscribe from several topic filters with a single unsubscribe packet, waiting for unsuback.
+ *  @param client - the client object to use
+ *  @param count - the number of topic filters
+ *  @param topicFilters - the topic filters to unsubscribe from
+ *  @return success code
+ */
+DLLExport int MQTTUnsubscribeMany(MQTTClient* client, int count, const char* topicFilters[]);
+
 /** MQTT Disconnect - send an MQTT disconnect packet and close the connection
  *  @param client - the client object to use
  *  @return success code
@@ -218,12 +581,26 @@ DLLExport int MQTTYield(MQTTClient* client, int time);
  */
 DLLExport int MQTTIsConnected(MQTTClient* client);
 
+/** MQTT next deadline - how long the reading task can block waiting for the network before the
+ *  client has timed work to do: a keepalive ping, a ping response overdue, gathered packets or batched
+ *  log records to write, or the write buffer delay while it is set. Used as the timeout of the next cycle so that an idle client doesn't poll.
+ *  @param client - the client object to use
+ *  @return the time, in milliseconds, between 0 and MAX_IDLE_WAIT_MS
+ */
+DLLExport int MQTTNextDeadline(MQTTClient* client);
+
 #if defined(MQTT_TASK)
 /** MQTT start background thread for a client.  After this, MQTTYield should not be called.
 *  @param client - the client object to use
 *  @return success code
 */
 DLLExport int MQTTStartTask(MQTTClient* client);
+
+/** MQTT release reader - unlock client->mutex, taken to call cycle from a task of the application, waking the
+ *  tasks that wait for the reading side to make progress so that one of them can take over reading.
+ *  @param client - the client object to use
+ */
+DLLExport void MQTTReleaseReader(MQTTClient* client);
 #endif
 
 #if defined(__cplusplus)
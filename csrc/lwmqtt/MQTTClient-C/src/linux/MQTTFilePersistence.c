@@ -0,0 +1,91 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2017 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#include "MQTTFilePersistence.h"
+
+#include <string.h>
+#include <unistd.h>
+
+
+static int file_append(void* context, int log, const unsigned char* data, size_t len)
+{
+	FILE* f = ((FilePersistence*)context)->files[log];
+
+	if (fseek(f, 0, SEEK_END) != 0 || fwrite(data, 1, len, f) != len)
+		return FAILURE;
+	return SUCCESS;
+}
+
+
+static int file_read(void* context, int log, size_t offset, unsigned char* data, size_t len)
+{
+	FILE* f = ((FilePersistence*)context)->files[log];
+	size_t rc;
+
+	if (fseek(f, offset, SEEK_SET) != 0)
+		return FAILURE;
+	rc = fread(data, 1, len, f);
+	return (rc == 0 && ferror(f)) ? FAILURE : (int)rc;
+}
+
+
+static int file_sync(void* context, int log)
+{
+	FILE* f = ((FilePersistence*)context)->files[log];
+
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+		return FAILURE;
+	return SUCCESS;
+}
+
+
+static int file_erase(void* context, int log)
+{
+	FILE* f = ((FilePersistence*)context)->files[log];
+
+	if (fflush(f) != 0 || ftruncate(fileno(f), 0) != 0)
+		return FAILURE;
+	rewind(f);
+	return SUCCESS;
+}
+
+
+int FilePersistenceInit(MQTTPersistence* persistence, FilePersistence* files, const char* path)
+{
+	char name[256];
+	int i;
+
+	for (i = 0; i < 2; ++i)
+	{
+		snprintf(name, sizeof(name), "%s.%d", path, i);
+		if ((files->files[i] = fopen(name, "r+b")) == NULL && (files->files[i] = fopen(name, "w+b")) == NULL)
+		{
+			while (--i >= 0)
+				fclose(files->files[i]);
+			return FAILURE;
+		}
+	}
+	persistence->context = files;
+	persistence->append = file_append;
+	persistence->read = file_read;
+	persistence->sync = file_sync;
+	persistence->erase = file_erase;
+	return SUCCESS;
+}
+
+
+void FilePersistenceClose(FilePersistence* files)
+{
+	fclose(files->files[0]);
+	fclose(files->files[1]);
+}
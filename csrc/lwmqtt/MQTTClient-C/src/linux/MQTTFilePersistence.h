@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * Copyright (c) 2014, 2017 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *******************************************************************************/
+
+#if !defined(MQTTFilePersistence_H)
+#define MQTTFilePersistence_H
+
+#include <stdio.h>
+
+#include "MQTTClient.h"
+
+/* Persistence log kept in two plain files, <path>.0 and <path>.1, for hosts with stdio and fsync.
+ * It is not part of the Zerynth build, where the storage of the log is provided by the board. */
+typedef struct FilePersistence
+{
+	FILE* files[2];
+} FilePersistence;
+
+/** Open, or create, the files of the log and fill the persistence vtable to give to MQTTSetPersistence
+ *  @param persistence - the vtable to fill
+ *  @param files - the file handles, must live as long as the persistence is used
+ *  @param path - the common prefix of the file names
+ *  @return success code
+ */
+DLLExport int FilePersistenceInit(MQTTPersistence* persistence, FilePersistence* files, const char* path);
+
+/** Close the files of the log, after MQTTSetPersistence(client, NULL) */
+DLLExport void FilePersistenceClose(FilePersistence* files);
+
+#endif
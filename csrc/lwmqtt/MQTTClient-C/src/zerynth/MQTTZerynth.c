@@ -46,6 +46,12 @@ int MutexLock(Mutex* mutex)
 	return 0;
 }
 
+// never blocks, so no need to release the GIL
+int MutexTryLock(Mutex* mutex)
+{
+	return (vosSemWaitTimeout(mutex->sem, VTIME_IMMEDIATE) == VRES_OK) ? 0 : -1;
+}
+
 int MutexUnlock(Mutex* mutex)
 {
     RELEASE_GIL();
@@ -55,6 +61,27 @@ int MutexUnlock(Mutex* mutex)
 }
 
 
+void SemaphoreInit(Semaphore* semaphore)
+{
+    semaphore->sem = vosSemCreate(0);
+}
+
+int SemaphoreWait(Semaphore* semaphore, int timeout_ms)
+{
+    int rc;
+
+    RELEASE_GIL();
+    rc = vosSemWaitTimeout(semaphore->sem, TIME_U(timeout_ms, MILLIS));
+    ACQUIRE_GIL();
+    return (rc == VRES_OK) ? 0 : -1;
+}
+
+void SemaphorePost(Semaphore* semaphore)
+{
+    vosSemSignal(semaphore->sem);
+}
+
+
 void TimerCountdownMS(Timer* timer, unsigned int timeout_ms)
 {
 	timer->millis_to_wait = timeout_ms;
@@ -135,6 +162,38 @@ int Zerynth_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
 }
 
 
+// single select + recv: returns whatever is available up to len, 0 if nothing arrived within timeout_ms
+// (a zero timeout just polls the socket)
+int Zerynth_recv(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    int rc;
+    struct timeval tv;
+    fd_set read_fds;
+
+    tv.tv_sec  = timeout_ms / 1000;
+    tv.tv_usec = ( timeout_ms % 1000 ) * 1000;
+
+    DEBUG2("Receiving up to %i bytes with socket %i",len,n->my_socket);
+    RELEASE_GIL();
+
+    FD_ZERO( &read_fds );
+    FD_SET(n->my_socket, &read_fds );
+
+    rc = gzsock_select(n->my_socket + 1, &read_fds, NULL, NULL, &tv );
+
+    if ( rc > 0 ) {
+        rc = gzsock_recv(n->my_socket, buffer, len, 0);
+        if ( rc <= 0 ) {
+            // readable but no data: the socket has been closed remotely
+            rc = ERR_CONN;
+        }
+    }
+    ACQUIRE_GIL();
+    DEBUG2("Received bytes %i with socket %i",rc,n->my_socket);
+    return rc;
+}
+
+
 int Zerynth_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
 {
 	int sentLen = 0;
@@ -162,6 +221,41 @@ int Zerynth_write(Network* n, unsigned char* buffer, int len, int timeout_ms)
 }
 
 
+// sends the buffers one after the other straight from where they are, without gathering them first:
+// returns the total number of bytes sent, which is short of the sum of the lengths on timeout
+int Zerynth_writev(Network* n, NetworkVector* vec, int count, int timeout_ms)
+{
+	int sentLen = 0;
+	int i, off;
+	uint64_t start_millis = vosMillis();
+
+    DEBUG2("Sending %i buffers with socket %i",count,n->my_socket);
+    RELEASE_GIL();
+    for (i = 0; i < count; i++)
+    {
+        off = 0;
+        while (off < vec[i].len && ((vosMillis() - start_millis) < timeout_ms))
+        {
+            int rc = gzsock_send(n->my_socket, vec[i].buf + off, vec[i].len - off, 0);
+
+            if (rc < 0)
+            {
+                sentLen = rc;
+                goto exit;
+            }
+            off += rc;
+        }
+        sentLen += off;
+        if (off < vec[i].len)
+            break;
+    }
+exit:
+    ACQUIRE_GIL();
+    DEBUG2("Sent bytes %i with socket %i",sentLen,n->my_socket);
+	return sentLen;
+}
+
+
 void Zerynth_disconnect(Network* n)
 {
     DEBUG2("MQTT disconnecting from socket %i",n->my_socket);
@@ -174,7 +268,9 @@ void NetworkInit(Network* n)
     DEBUG2("MQTT configured with Zerynth sockets","");
 	n->my_socket = 0;
 	n->mqttread = Zerynth_read;
+	n->mqttrecv = Zerynth_recv;
 	n->mqttwrite = Zerynth_write;
+	n->mqttwritev = Zerynth_writev;
 	n->disconnect = Zerynth_disconnect;
 }
 
@@ -24,6 +24,10 @@
 
 #include "snprintf.h"
 
+// subscriptions pool and topic filter copies come from the VM heap
+#define MQTTMalloc gc_malloc
+#define MQTTFree gc_free
+
 typedef struct Timer 
 {
 	uint64_t start_millis;
@@ -32,11 +36,19 @@ typedef struct Timer
 
 typedef struct Network Network;
 
+typedef struct NetworkVector
+{
+	unsigned char* buf;
+	int len;
+} NetworkVector;
+
 struct Network
 {
 	int my_socket;
 	int (*mqttread) (Network*, unsigned char*, int, int);
+	int (*mqttrecv) (Network*, unsigned char*, int, int);
 	int (*mqttwrite) (Network*, unsigned char*, int, int);
+	int (*mqttwritev) (Network*, NetworkVector*, int, int);
 	void (*disconnect) (Network*);
 };
 
@@ -53,8 +65,18 @@ typedef struct Mutex
 
 void MutexInit(Mutex*);
 int MutexLock(Mutex*);
+int MutexTryLock(Mutex*);
 int MutexUnlock(Mutex*);
 
+typedef struct Semaphore
+{
+	VSemaphore sem;
+} Semaphore;
+
+void SemaphoreInit(Semaphore*);
+int SemaphoreWait(Semaphore*, int);
+void SemaphorePost(Semaphore*);
+
 typedef struct Thread
 {
 	VThread task;
@@ -63,7 +85,9 @@ typedef struct Thread
 int ThreadStart(Thread*, void (*fn)(void*), void* arg);
 
 int Zerynth_read(Network*, unsigned char*, int, int);
+int Zerynth_recv(Network*, unsigned char*, int, int);
 int Zerynth_write(Network*, unsigned char*, int, int);
+int Zerynth_writev(Network*, NetworkVector*, int, int);
 void Zerynth_disconnect(Network*);
 
 void NetworkInit(Network*);
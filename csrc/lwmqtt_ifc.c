@@ -13,6 +13,7 @@
 //#define printf(...) vbl_printf_stdout(__VA_ARGS__)
 
 unsigned char mqtt_sendbuf[2048], mqtt_readbuf[2048];
+uint8_t *mqtt_writebuf; // small outgoing packets gathered to be written at once, if enabled
 uint8_t *mqtt_client_username, *mqtt_client_password, *mqtt_clientid; 
 
 MQTTPacket_connectData mqtt_connectData = MQTTPacket_connectData_initializer;
@@ -22,40 +23,99 @@ Network mqtt_network;
 
 Timer cycle_timer;
 
-// it is not possible to know if subscription callbacks will be called in a cycle from the mqtt recv
-// task (the Python one executing callback) or from the main (after a wait_for), so the need to protect
-// the shared object via a mutex
+// received messages are queued for the Python loop in a single producer / single consumer ring:
+// the slots are the items of a Python list, so that the GC sees queued objects, the indexes live here.
+// Whatever task reads the network produces (reading is serialized by the client), only the Python loop
+// consumes: each side only writes its own index, no mutex is needed to queue and take. Only conflating
+// subscriptions update queued items, under activated_callbacks_mutex, which the take holds as well
+#define activated_callbacks_barrier() __sync_synchronize()
+// ring indexes run over twice the ring size: a full ring is told from an empty one, and an index wraps
+// together with the slot it points to, whatever the size
+#define ring_advance(i, n, size) (((i) + (n)) % (2 * (size)))
+#define ring_used(head, tail, size) (((tail) + 2 * (size) - (head)) % (2 * (size)))
+#define ring_slot(i, size) ((i) % (size))
+#define activated_callbacks_used() ring_used(activated_callbacks_head, activated_callbacks_tail, activated_callbacks_size)
 Mutex activated_callbacks_mutex;
 PObject *activated_callbacks;
-
-uint8_t *subscribed_topics_cstrings[MAX_MESSAGE_HANDLERS];
-uint32_t select_loop_time=500;
-
+uint32_t activated_callbacks_size;
+volatile uint32_t activated_callbacks_head, activated_callbacks_tail;
+uint32_t activated_callbacks_high_water, activated_callbacks_dropped;
+
+// receive backpressure: once dispatch_pause_at messages are queued the client leaves further publishes unread,
+// so that TCP flow control holds the broker back, until the Python loop takes the queue. The loop dispatches
+// what it took before reading again, so there is no lower mark to wait for.
+// A dispatch_pause_at of 0 reads on and drops what the ring has no room for
+uint32_t dispatch_pause_at;
+
+// optional pool of Python bytearrays that received payloads are copied into, instead of a new string each.
+// Buffers are handed out in ring order by the task reading the network, and given back all at once by the
+// next take: by then the Python loop has returned from every callback of the previous batch. Same indexes as the ring
+PObject *payload_pool;
+uint32_t payload_pool_count, payload_pool_size;
+volatile uint32_t payload_pool_head, payload_pool_tail; // given back / handed out
+uint32_t payload_pool_taken;                            // passed to Python, only the consumer writes it
+
+uint32_t select_loop_time=0;
+
+// once a packet has come in, a cycle keeps handling what the socket already holds, so that bursts reach
+// Python in one batch: at most cycle_drain_packets packets, for at most CYCLE_DRAIN_MS
+#define CYCLE_DRAIN_MS 50
+uint32_t cycle_drain_packets=1;
+
+// QoS1/QoS2 publishes completed since the last _mqtt_published call: packet id on ack, -packet id on failure.
+// Filled by any task completing an exchange, while the client write lock is held. When Python doesn't keep up
+// the oldest notifications are dropped, and counted
+#define PUBLISHED_QUEUE_SIZE (2 * MAX_INFLIGHT_MESSAGES)
+Mutex published_mutex;
+int32_t published_ids[PUBLISHED_QUEUE_SIZE];
+uint32_t published_head, published_count, published_dropped;
+
+// manual acks: QoS1/QoS2 messages reach Python with their packet id and are acked by _mqtt_ack. They are never
+// dropped: receiving pauses before the ring is full (a pause mark of 0 is refused), and they are not conflated
+uint32_t manual_ack;
+
+
+static int stream_handler(int event, MessageData* data);
+static void dispatch_resume(void);
 
 C_NATIVE(_mqtt_init) {
     NATIVE_UNWARN();
 
     uint8_t *clientid;
-    uint32_t clientid_len, i;
-    int32_t cleansession, command_timeout;
+    uint32_t clientid_len;
+    int32_t cleansession, command_timeout, inflight_window, stream_chunk;
 
     activated_callbacks = args[0];
+    activated_callbacks_size = PSEQUENCE_ELEMENTS(activated_callbacks);
+    if (activated_callbacks_size == 0)
+        return ERR_VALUE_EXC;
+    activated_callbacks_head = 0;
+    activated_callbacks_tail = 0;
+    activated_callbacks_high_water = 0;
+    activated_callbacks_dropped = 0;
+    dispatch_pause_at = activated_callbacks_size;
+    payload_pool_count = 0;
+    manual_ack = 0;
     nargs--;
     args++;
 
+    MutexInit(&published_mutex);
     MutexInit(&activated_callbacks_mutex);
 
-    if (parse_py_args("siii", nargs, args, &clientid, &clientid_len, &cleansession, &select_loop_time, &command_timeout) != 4)
+    if (parse_py_args("siiiiii", nargs, args, &clientid, &clientid_len, &cleansession, &select_loop_time, &command_timeout, &inflight_window, &stream_chunk, &cycle_drain_packets) != 7)
         return ERR_TYPE_EXC;
+    if (cycle_drain_packets < 1)
+        cycle_drain_packets = 1;
 
 
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++) {
-        subscribed_topics_cstrings[i] = NULL;
-    }
-
     NetworkInit(&mqtt_network);
     MQTTClientInit(&paho_mqtt_client, &mqtt_network, command_timeout,
                     mqtt_sendbuf, sizeof(mqtt_sendbuf), mqtt_readbuf, sizeof(mqtt_readbuf));
+    MQTTSetInflightWindow(&paho_mqtt_client, inflight_window);
+    MQTTSetStreamHandler(&paho_mqtt_client, stream_handler, stream_chunk);
+    published_head = 0;
+    published_count = 0;
+    published_dropped = 0;
 
     TimerInit(&cycle_timer);
 
@@ -70,16 +130,6 @@ C_NATIVE(_mqtt_init) {
 }
 
 
-static void clean_session(void) {
-    int32_t i;
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++) {
-        if (subscribed_topics_cstrings[i] != NULL) {
-            gc_free(subscribed_topics_cstrings[i]);
-            subscribed_topics_cstrings[i] = NULL;
-        }
-    }
-}
-
 C_NATIVE(_mqtt_set_username_pw) {
 
     uint32_t username_len, password_len;
@@ -147,9 +197,6 @@ C_NATIVE(_mqtt_connect) {
         return ERR_IOERROR_EXC;
     }
     *res = PSMALLINT_NEW(rc);
-    // make sure we start with clean session data, if so requested
-    if (paho_mqtt_client.cleansession)
-        clean_session();
     return ERR_OK;
 }
 
@@ -160,43 +207,275 @@ C_NATIVE(_mqtt_connected) {
     return ERR_OK;
 }
 
+// the packet id assigned to the message, -1 when discarded: by the queue policy when offline, or too big for the buffer
+static int publish_result(int rc, MQTTMessage *message, PObject **res) {
+    if (rc == BUFFER_OVERFLOW) {
+        *res = PSMALLINT_NEW(-1);
+        return ERR_OK;
+    }
+    if (rc == REQUEUED) {
+        *res = PSMALLINT_NEW(0); // queued again, as when offline
+        return ERR_OK;
+    }
+    if (rc != 0)
+        return ERR_IOERROR_EXC;
+
+    *res = PSMALLINT_NEW(message->id);
+    return ERR_OK;
+}
+
 C_NATIVE(_mqtt_publish) {
     NATIVE_UNWARN();
 
     MQTTMessage message;
     uint8_t *topic, *payload;
-    uint32_t qos, retain, topic_len, payload_len;
+    uint32_t qos, retain, wait, topic_len, payload_len;
+    int rc;
 
-    if (parse_py_args("ssii", nargs, args, &topic, &topic_len, &payload, &payload_len, &qos, &retain) != 4)
+    if (parse_py_args("ssiii", nargs, args, &topic, &topic_len, &payload, &payload_len, &qos, &retain, &wait) != 5)
         return ERR_TYPE_EXC;
 
     message.qos = qos;
     message.retained = retain;
     message.payload = payload;
     message.payloadlen = payload_len;
+    message.id = 0;
 
     uint8_t *cstring_topic = gc_malloc(topic_len + 1); // convert topic from bytes sequence to cstring
     memcpy(cstring_topic, topic, topic_len);
     cstring_topic[topic_len] = 0;
 
-    if (MQTTPublish(&paho_mqtt_client, cstring_topic, &message) != 0){
-    	gc_free(cstring_topic);
+    if (wait)
+        rc = MQTTPublish(&paho_mqtt_client, cstring_topic, &message);
+    else
+        rc = MQTTPublishAsync(&paho_mqtt_client, cstring_topic, &message);
+
+    gc_free(cstring_topic);
+    return publish_result(rc, &message, res);
+}
+
+// same as _mqtt_publish, for a topic handle: the topic followed by a zero byte, built once by Python,
+// is serialized from where it is instead of being copied and measured again
+C_NATIVE(_mqtt_publish_handle) {
+    NATIVE_UNWARN();
+
+    MQTTMessage message;
+    MQTTString mqtt_topic = MQTTString_initializer;
+    uint8_t *topic, *payload;
+    uint32_t qos, retain, wait, topic_len, payload_len;
+    int rc;
+
+    if (parse_py_args("ssiii", nargs, args, &topic, &topic_len, &payload, &payload_len, &qos, &retain, &wait) != 5)
+        return ERR_TYPE_EXC;
+    if (topic_len < 2 || topic[topic_len - 1] != 0)
+        return ERR_VALUE_EXC;
+
+    message.qos = qos;
+    message.retained = retain;
+    message.payload = payload;
+    message.payloadlen = payload_len;
+    message.id = 0;
+    mqtt_topic.lenstring.len = topic_len - 1;
+    mqtt_topic.lenstring.data = (char*)topic;
+
+    if (wait)
+        rc = MQTTPublishTopic(&paho_mqtt_client, &mqtt_topic, &message);
+    else
+        rc = MQTTPublishTopicAsync(&paho_mqtt_client, &mqtt_topic, &message);
+
+    return publish_result(rc, &message, res);
+}
+
+C_NATIVE(_mqtt_set_offline_queue) {
+    NATIVE_UNWARN();
+
+    int32_t budget, policy;
+
+    if (parse_py_args("ii", nargs, args, &budget, &policy) != 2)
+        return ERR_TYPE_EXC;
+    if (budget < 0 || (policy != QUEUE_DROP_OLDEST && policy != QUEUE_DROP_NEWEST))
+        return ERR_VALUE_EXC;
+
+    MQTTSetOfflineQueue(&paho_mqtt_client, budget, policy);
+    *res = MAKE_NONE();
+    return ERR_OK;
+}
+
+C_NATIVE(_mqtt_offline_queue_stats) {
+    NATIVE_UNWARN();
+
+    PObject *stats[3];
+    stats[0] = PSMALLINT_NEW(paho_mqtt_client.queue_count);
+    stats[1] = PSMALLINT_NEW(paho_mqtt_client.queue_bytes);
+    stats[2] = PSMALLINT_NEW(paho_mqtt_client.queue_dropped);
+    *res = ptuple_new(3, stats);
+    return ERR_OK;
+}
+
+// size 0 goes back to writing every packet at once
+C_NATIVE(_mqtt_set_write_buffer) {
+    NATIVE_UNWARN();
+
+    int32_t size, delay;
+    uint8_t *buf = NULL;
+    int rc;
+
+    if (parse_py_args("ii", nargs, args, &size, &delay) != 2)
+        return ERR_TYPE_EXC;
+    if (size < 0 || delay < 1)
+        return ERR_VALUE_EXC;
+
+    if (size > 0)
+        buf = gc_malloc(size);
+    rc = MQTTSetWriteBuffer(&paho_mqtt_client, buf, size, delay);
+    if (mqtt_writebuf)
+        gc_free(mqtt_writebuf); // what it held has been written
+    mqtt_writebuf = buf;
+    if (rc != 0)
+        return ERR_IOERROR_EXC;
+    *res = MAKE_NONE();
+    return ERR_OK;
+}
+
+C_NATIVE(_mqtt_flush) {
+    NATIVE_UNWARN();
+
+    if (MQTTFlush(&paho_mqtt_client) != 0)
         return ERR_IOERROR_EXC;
+    *res = MAKE_NONE();
+    return ERR_OK;
+}
+
+C_NATIVE(_mqtt_published_stats) {
+    NATIVE_UNWARN();
+
+    PObject *stats[2];
+
+    MutexLock(&published_mutex);
+    stats[0] = PSMALLINT_NEW(published_count);
+    stats[1] = PSMALLINT_NEW(published_dropped);
+    MutexUnlock(&published_mutex);
+    *res = ptuple_new(2, stats);
+    return ERR_OK;
+}
+
+C_NATIVE(_mqtt_set_manual_ack) {
+    NATIVE_UNWARN();
+
+    int32_t window;
+
+    if (parse_py_args("i", nargs, args, &window) != 1)
+        return ERR_TYPE_EXC;
+    if (window < 0 || (window > 0 && dispatch_pause_at == 0))
+        return ERR_VALUE_EXC;
+
+    manual_ack = (window > 0);
+    MQTTSetManualAck(&paho_mqtt_client, window);
+    *res = MAKE_NONE();
+    return ERR_OK;
+}
+
+// True if the message was waiting for its ack and the ack was sent
+C_NATIVE(_mqtt_ack) {
+    NATIVE_UNWARN();
+
+    int32_t packet_id;
+
+    if (parse_py_args("i", nargs, args, &packet_id) != 1)
+        return ERR_TYPE_EXC;
+    if (packet_id < 1 || packet_id > 65535)
+        return ERR_VALUE_EXC;
+
+    *res = (MQTTAck(&paho_mqtt_client, packet_id) == 0) ? PBOOL_TRUE() : PBOOL_FALSE();
+    return ERR_OK;
+}
+
+static void published_handler(unsigned short packetid, int rc) {
+    if (rc == REQUEUED)
+        return; // reported when sent again, under its new packet id
+    MutexLock(&published_mutex);
+    if (published_count == PUBLISHED_QUEUE_SIZE) {
+        // Python loop is not keeping up, forget the oldest notification
+        published_head = (published_head + 1) % PUBLISHED_QUEUE_SIZE;
+        published_count--;
+        published_dropped++;
     }
+    published_ids[(published_head + published_count) % PUBLISHED_QUEUE_SIZE] = (rc == SUCCESS) ? packetid : -packetid;
+    published_count++;
+    MutexUnlock(&published_mutex);
+}
 
-    gc_free(cstring_topic);
+C_NATIVE(_mqtt_notify_published) {
+    NATIVE_UNWARN();
+
+    int32_t enable;
+
+    if (parse_py_args("i", nargs, args, &enable) != 1)
+        return ERR_TYPE_EXC;
+
+    MQTTSetPublishHandler(&paho_mqtt_client, (enable) ? published_handler : NULL);
+    if (!enable) {
+        // nobody takes them any more: left queued they would keep the loop from waiting
+        MutexLock(&published_mutex);
+        published_head = 0;
+        published_count = 0;
+        MutexUnlock(&published_mutex);
+    }
     *res = MAKE_NONE();
     return ERR_OK;
 }
 
+C_NATIVE(_mqtt_published) {
+    NATIVE_UNWARN();
+
+    PObject *ids[PUBLISHED_QUEUE_SIZE];
+    uint32_t i, count;
+
+    MutexLock(&published_mutex);
+    count = published_count;
+    for (i = 0; i < count; i++) {
+        ids[i] = PSMALLINT_NEW(published_ids[(published_head + i) % PUBLISHED_QUEUE_SIZE]);
+    }
+    published_head = (published_head + count) % PUBLISHED_QUEUE_SIZE;
+    published_count = 0;
+    MutexUnlock(&published_mutex);
+
+    *res = (count) ? (PObject *)ptuple_new(count, ids) : MAKE_NONE();
+    return ERR_OK;
+}
+
 C_NATIVE(_mqtt_cycle) {
     NATIVE_UNWARN();
 
-    int packet_handled;
+    int packet_handled, wait;
+    uint32_t drained;
+    Timer drain_timer;
+    // a pause the last take couldn't see yet would hold the loop itself
+    dispatch_resume();
+    // only the reading side of the client is held here: publishers from other threads
+    // don't wait for the select below, they take the client write lock
     MutexLock(&paho_mqtt_client.mutex);
-    TimerCountdownMS(&cycle_timer, select_loop_time); /* Don't wait too long if no traffic is incoming */
+    // block until traffic comes in or the client has timed work to do, the loop timeout only caps the wait.
+    // Publishes completed by other tasks (e.g. failed on reconnect) must not wait for the next packet to be reported
+    wait = MQTTNextDeadline(&paho_mqtt_client);
+    if (select_loop_time > 0 && wait > (int)select_loop_time)
+        wait = select_loop_time;
+    if (published_count > 0 && paho_mqtt_client.publishCompleteHandler != NULL)
+        wait = 0;
+    TimerCountdownMS(&cycle_timer, wait);
     packet_handled = cycle(&paho_mqtt_client, &cycle_timer);
-    MutexUnlock(&paho_mqtt_client.mutex);
+
+    // drain without waiting: stop when nothing complete is buffered or the socket is empty (cycle returns 0),
+    // on the budget, or when the ring is full, since a further message would be dropped
+    TimerInit(&drain_timer);
+    TimerCountdownMS(&drain_timer, CYCLE_DRAIN_MS);
+    for (drained = 1; packet_handled > 0 && drained < cycle_drain_packets && paho_mqtt_client.isconnected &&
+            !TimerIsExpired(&drain_timer) &&
+            activated_callbacks_used() < activated_callbacks_size; drained++) {
+        TimerCountdownMS(&cycle_timer, 0);
+        packet_handled = cycle(&paho_mqtt_client, &cycle_timer);
+    }
+    MQTTReleaseReader(&paho_mqtt_client); // a publisher waiting for an ack takes over reading while Python runs
 
     if (packet_handled < 0 || !paho_mqtt_client.isconnected) {
         // cycle returns packet_type or error code < 0
@@ -206,96 +485,258 @@ C_NATIVE(_mqtt_cycle) {
     return ERR_OK;
 }
 
+// producer side: returns -1 if the ring is full
+static int activated_callbacks_put(PObject *item) {
+    uint32_t used = activated_callbacks_used();
+
+    if (used == activated_callbacks_size)
+        return -1;
+    PLIST_SET_ITEM(activated_callbacks, ring_slot(activated_callbacks_tail, activated_callbacks_size), item);
+    activated_callbacks_barrier(); // the item must be in place before the consumer can see it
+    activated_callbacks_tail = ring_advance(activated_callbacks_tail, 1, activated_callbacks_size);
+    if (used + 1 > activated_callbacks_high_water)
+        activated_callbacks_high_water = used + 1;
+    if (dispatch_pause_at > 0 && used + 1 >= dispatch_pause_at)
+        MQTTPauseReceive(&paho_mqtt_client, 1);
+    return 0;
+}
+
+// consumer side: lets the client read publishes again once the queue is below the pause mark
+static void dispatch_resume(void) {
+    if (paho_mqtt_client.receive_paused &&
+        (dispatch_pause_at == 0 || activated_callbacks_used() < dispatch_pause_at))
+        MQTTPauseReceive(&paho_mqtt_client, 0);
+}
+
+// the client knows subscriptions by the id Python gave them, shifted left, with the lowest bit set for
+// conflating ones: all subscriptions have the same handler, so a message is queued once whatever matches it
+#define subscription_client_id(id, conflate) (((id) << 1) | ((conflate) ? 1 : 0))
+#define subscription_python_id(id) ((id) >> 1)
+#define subscription_conflates(id) ((id) & 1)
+
+// the ids Python gave to the subscriptions matching the message: callbacks are found without matching topics again
+static PObject *subscription_ids(MessageData* data) {
+    PTuple *ids = ptuple_new(data->subscription_count, NULL);
+    int i;
+
+    for (i = 0; i < data->subscription_count; i++)
+        PTUPLE_SET_ITEM(ids, i, PSMALLINT_NEW(subscription_python_id(data->subscriptions[i])));
+    return ids;
+}
+
+static int conflate(MessageData* data);
+
+// a message is conflated only if all the subscriptions it matches conflate: the others must see every message
+static int conflating(MessageData* data) {
+    int i;
+
+    for (i = 0; i < data->subscription_count; i++) {
+        if (!subscription_conflates(data->subscriptions[i]))
+            return 0;
+    }
+    return data->subscription_count > 0;
+}
+
 static void messages_handler(MessageData* data) {
+    if (conflating(data) && conflate(data))
+        return;
+
+    if (activated_callbacks_used() == activated_callbacks_size) {
+        // Python loop is not keeping up, and receiving is not paused before the ring is full: not with manual acks
+        activated_callbacks_dropped++;
+        return;
+    }
+
+    PObject *topic_payload[5];
+    topic_payload[0] = pstring_new(data->topicName->lenstring.len, data->topicName->lenstring.data);
+    if (payload_pool_count > 0 && data->message->payloadlen <= payload_pool_size &&
+        ring_used(payload_pool_head, payload_pool_tail, payload_pool_count) < payload_pool_count) {
+        PObject *buffer = PLIST_ITEM(payload_pool, ring_slot(payload_pool_tail, payload_pool_count));
+        memcpy(PSEQUENCE_BYTES(buffer), data->message->payload, data->message->payloadlen);
+        PSEQUENCE_ELEMENTS_SET(buffer, data->message->payloadlen);
+        payload_pool_tail = ring_advance(payload_pool_tail, 1, payload_pool_count);
+        topic_payload[1] = buffer;
+    } else
+        topic_payload[1] = pstring_new(data->message->payloadlen, data->message->payload);
+    topic_payload[2] = subscription_ids(data);
+    if (manual_ack) {
+        // (topic, payload, subscription ids, packet id, qos): the packet id is only meaningful with qos > 0
+        topic_payload[3] = PSMALLINT_NEW(data->message->id);
+        topic_payload[4] = PSMALLINT_NEW(data->message->qos);
+    }
+    PTuple *topic_payload_tuple = ptuple_new((manual_ack) ? 5 : 3, topic_payload);
+    activated_callbacks_put(topic_payload_tuple);
+}
+
+// a message of a conflating subscription replaces the payload of the message queued for the same topic and
+// subscriptions, if any, so that the callback only gets the latest value. Returns 1 if the message was merged
+static int conflate(MessageData* data) {
+    PObject *item, *ids, *payload;
     uint32_t i;
+    int k, replaced = 0;
+    size_t len = data->message->payloadlen;
 
     MutexLock(&activated_callbacks_mutex);
-
-    int free_slot = -1;
-    for (i = 0; i < PSEQUENCE_ELEMENTS(activated_callbacks); i++) {
-        if (PTYPE(PLIST_ITEM(activated_callbacks, i)) == PNONE) {
-            free_slot = i;
-            break;
+    for (i = activated_callbacks_used(); i > 0 && !replaced; i--) {
+        item = PLIST_ITEM(activated_callbacks,
+                          ring_slot(ring_advance(activated_callbacks_head, i - 1, activated_callbacks_size), activated_callbacks_size));
+        if (PSEQUENCE_ELEMENTS(item) != ((manual_ack) ? 5 : 3))
+            continue; // stream events, or queued before the ack mode changed
+        if (manual_ack && PSMALLINT_VALUE(PTUPLE_ITEM(item, 4)) != QOS0)
+            continue; // Python must see it to ack it
+        if (PSEQUENCE_ELEMENTS(PTUPLE_ITEM(item, 0)) != data->topicName->lenstring.len ||
+            memcmp(PSEQUENCE_BYTES(PTUPLE_ITEM(item, 0)), data->topicName->lenstring.data, data->topicName->lenstring.len))
+            continue;
+        ids = PTUPLE_ITEM(item, 2);
+        if (PSEQUENCE_ELEMENTS(ids) != data->subscription_count)
+            continue;
+        for (k = 0; k < data->subscription_count &&
+             PSMALLINT_VALUE(PTUPLE_ITEM(ids, k)) == subscription_python_id(data->subscriptions[k]); k++)
+            ;
+        if (k < data->subscription_count)
+            continue;
+
+        payload = PTUPLE_ITEM(item, 1);
+        if (PTYPE(payload) == PBYTEARRAY) {
+            // a pool buffer is kept in its place, pool buffers are given back in the order they were handed out
+            if (len > payload_pool_size)
+                break;
+            memcpy(PSEQUENCE_BYTES(payload), data->message->payload, len);
+            PSEQUENCE_ELEMENTS_SET(payload, len);
+        } else
+            PTUPLE_SET_ITEM(item, 1, pstring_new(len, data->message->payload));
+        if (manual_ack) {
+            PTUPLE_SET_ITEM(item, 3, PSMALLINT_NEW(data->message->id));
+            PTUPLE_SET_ITEM(item, 4, PSMALLINT_NEW(data->message->qos));
         }
+        replaced = 1;
     }
+    MutexUnlock(&activated_callbacks_mutex);
+    return replaced;
+}
 
-    if (free_slot == -1) {
-        goto exit;
+// messages bigger than mqtt_readbuf are activated as a sequence of (topic, payload length, subscription ids, STREAM_BEGIN),
+// (None, payload chunk, None, STREAM_DATA) and (None, None, None, STREAM_END) entries, with manual acks the STREAM_END
+// entry of a QoS1/QoS2 message carries its packet id instead of the second None. Chunks must not be lost:
+// when the ring is full the client is told to offer the same event again on the next cycle
+static int stream_handler(int event, MessageData* data) {
+    if (activated_callbacks_used() == activated_callbacks_size)
+        return -1;
+
+    PObject *stream_event[4];
+    stream_event[0] = MAKE_NONE();
+    stream_event[1] = MAKE_NONE();
+    stream_event[2] = MAKE_NONE();
+    stream_event[3] = PSMALLINT_NEW(event);
+    if (event == STREAM_BEGIN) {
+        stream_event[0] = pstring_new(data->topicName->lenstring.len, data->topicName->lenstring.data);
+        stream_event[1] = PSMALLINT_NEW(data->message->payloadlen);
+        stream_event[2] = subscription_ids(data);
+    } else if (event == STREAM_DATA) {
+        stream_event[1] = pstring_new(data->message->payloadlen, data->message->payload);
+    } else if (event == STREAM_END && manual_ack && data->message->qos != QOS0) {
+        stream_event[1] = PSMALLINT_NEW(data->message->id);
     }
+    PTuple *stream_event_tuple = ptuple_new(4, stream_event);
+    return activated_callbacks_put(stream_event_tuple);
+}
 
-    PObject *topic_payload[2];
-    topic_payload[0] = pstring_new(data->topicName->lenstring.len, data->topicName->lenstring.data);
-    topic_payload[1] = pstring_new(data->message->payloadlen, data->message->payload);
-    PTuple *topic_payload_tuple = ptuple_new(2, topic_payload);
-    PLIST_SET_ITEM(activated_callbacks, free_slot, topic_payload_tuple);
+// copies a python list of topic strings into zero terminated cstrings, all in one gc_malloc block
+static char **topic_cstrings(PObject *topics, int count) {
+    int i, size = count * sizeof(char*);
 
-exit:
-    MutexUnlock(&activated_callbacks_mutex);
+    for (i = 0; i < count; i++) {
+        PObject *topic = PLIST_ITEM(topics, i);
+        if (PTYPE(topic) != PSTRING)
+            return NULL;
+        size += PSEQUENCE_ELEMENTS(topic) + 1;
+    }
+    char **cstrings = gc_malloc(size);
+    char *cstring = (char*)(cstrings + count);
+    for (i = 0; i < count; i++) {
+        PObject *topic = PLIST_ITEM(topics, i);
+        int topic_len = PSEQUENCE_ELEMENTS(topic);
+        memcpy(cstring, PSEQUENCE_BYTES(topic), topic_len);
+        cstring[topic_len] = 0;
+        cstrings[i] = cstring;
+        cstring += topic_len + 1;
+    }
+    return cstrings;
 }
 
+// subscribes to a list of topics with a single packet, returns the tuple of granted qos (0x80 on refusal).
+// With conflate, a message replaces the one still queued for the same topic, unless it matches other subscriptions
 C_NATIVE(_mqtt_subscribe) {
     NATIVE_UNWARN();
 
-    uint32_t topic_len, i, qos;
-    uint8_t *topic;
+    PObject *topics, *qoss, *ids;
+    int count, i, rc;
 
-    if (parse_py_args("si", nargs, args, &topic, &topic_len, &qos) != 2)
+    if (nargs != 4)
         return ERR_TYPE_EXC;
-
-    int free_slot = -1;
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++) {
-        if (subscribed_topics_cstrings[i] == NULL) {
-            free_slot = i;
-            break;
-        }
-    }
-
-    if (free_slot == -1) {
-        // no more subscription slots
+    topics = args[0];
+    qoss = args[1];
+    ids = args[2];
+    if (PTYPE(topics) != PLIST || PTYPE(qoss) != PLIST || PTYPE(ids) != PLIST || !IS_PSMALLINT(args[3]))
+        return ERR_TYPE_EXC;
+    count = PSEQUENCE_ELEMENTS(topics);
+    if (count == 0 || PSEQUENCE_ELEMENTS(qoss) != count || PSEQUENCE_ELEMENTS(ids) != count)
         return ERR_VALUE_EXC;
+    for (i = 0; i < count; i++) {
+        if (!IS_PSMALLINT(PLIST_ITEM(qoss, i)) || !IS_PSMALLINT(PLIST_ITEM(ids, i)))
+            return ERR_TYPE_EXC;
     }
 
-    subscribed_topics_cstrings[free_slot] = gc_malloc(topic_len + 1);
-    subscribed_topics_cstrings[free_slot][topic_len] = 0;
-    memcpy(subscribed_topics_cstrings[free_slot], topic, topic_len);
+    // the client keeps its own copy of the topic filters
+    char **cstrings = topic_cstrings(topics, count);
+    if (cstrings == NULL)
+        return ERR_TYPE_EXC;
+    int *values = gc_malloc(2 * count * sizeof(int));
+    enum QoS *qos = gc_malloc(count * sizeof(enum QoS));
+    for (i = 0; i < count; i++) {
+        qos[i] = (enum QoS)PSMALLINT_VALUE(PLIST_ITEM(qoss, i));
+        values[i] = subscription_client_id(PSMALLINT_VALUE(PLIST_ITEM(ids, i)), PSMALLINT_VALUE(args[3]));
+    }
 
-    if (MQTTSubscribe(&paho_mqtt_client, subscribed_topics_cstrings[free_slot], qos, messages_handler) != 0) {
-        gc_free(subscribed_topics_cstrings[free_slot]);
-        subscribed_topics_cstrings[free_slot] = NULL;
+    rc = MQTTSubscribeMany(&paho_mqtt_client, count, (const char**)cstrings, qos, messages_handler, values, values + count);
+    gc_free(qos);
+    gc_free(cstrings);
+    if (rc != 0) {
+        gc_free(values);
         return ERR_IOERROR_EXC;
     }
-    *res = MAKE_NONE();
+
+    PTuple *granted = ptuple_new(count, NULL);
+    for (i = 0; i < count; i++)
+        PTUPLE_SET_ITEM(granted, i, PSMALLINT_NEW(values[count + i]));
+    gc_free(values);
+
+    *res = granted;
     return ERR_OK;
 }
 
+// unsubscribes from a list of topics with a single packet
 C_NATIVE(_mqtt_unsubscribe) {
     NATIVE_UNWARN();
 
-    uint32_t topic_len, i;
-    uint8_t *topic;
+    PObject *topics;
+    int count, rc;
 
-    if (parse_py_args("s", nargs, args, &topic, &topic_len) != 1)
+    if (nargs != 1 || PTYPE(args[0]) != PLIST)
         return ERR_TYPE_EXC;
-
-    int free_slot = -1;
-    for (i = 0; i < MAX_MESSAGE_HANDLERS; i++) {
-        if (memcmp(subscribed_topics_cstrings[i], topic, topic_len) == 0) {
-            free_slot = i;
-            break;
-        }
-    }
-
-    if (free_slot == -1) {
-        // no more subscription slots
+    topics = args[0];
+    count = PSEQUENCE_ELEMENTS(topics);
+    if (count == 0)
         return ERR_VALUE_EXC;
-    }
 
-    if (MQTTUnsubscribe(&paho_mqtt_client, subscribed_topics_cstrings[free_slot]) != 0) {
+    char **cstrings = topic_cstrings(topics, count);
+    if (cstrings == NULL)
+        return ERR_TYPE_EXC;
+    rc = MQTTUnsubscribeMany(&paho_mqtt_client, count, (const char**)cstrings);
+    gc_free(cstrings);
+    if (rc != 0)
         return ERR_IOERROR_EXC;
-    }
 
-    gc_free(subscribed_topics_cstrings[free_slot]);
-    subscribed_topics_cstrings[free_slot] = NULL;
     *res = MAKE_NONE();
     return ERR_OK;
 }
@@ -303,10 +744,6 @@ C_NATIVE(_mqtt_unsubscribe) {
 C_NATIVE(_mqtt_disconnect) {
     NATIVE_UNWARN();
 
-    // make sure we release memory for session data, if clean session requested
-    if (paho_mqtt_client.cleansession)
-        clean_session();
-    
     if (MQTTDisconnect(&paho_mqtt_client) < 0) {
         return ERR_IOERROR_EXC;
     }
@@ -314,18 +751,103 @@ C_NATIVE(_mqtt_disconnect) {
     return ERR_OK;
 }
 
-C_NATIVE(_mqtt_activated_cbks_acquire) {
+// consumer side: moves all the queued entries out of the ring, returns them as a tuple or None if empty
+C_NATIVE(_mqtt_activated_cbks_take) {
+    NATIVE_UNWARN();
+
+    uint32_t head, count, i;
+
     MutexLock(&activated_callbacks_mutex);
+    head = activated_callbacks_head;
+    count = ring_used(head, activated_callbacks_tail, activated_callbacks_size);
+
+    // the callbacks of the previous batch have returned: its pool buffers can be filled again
+    activated_callbacks_barrier();
+    payload_pool_head = payload_pool_taken;
+
+    if (count == 0) {
+        MutexUnlock(&activated_callbacks_mutex);
+        *res = MAKE_NONE();
+        return ERR_OK;
+    }
+    activated_callbacks_barrier(); // read the items only after the tail that published them
+    PTuple *taken = ptuple_new(count, NULL);
+    for (i = 0; i < count; i++) {
+        uint32_t slot = ring_slot(ring_advance(head, i, activated_callbacks_size), activated_callbacks_size);
+        PObject *item = PLIST_ITEM(activated_callbacks, slot);
+        // pooled payloads come in the order their buffers were handed out
+        if (payload_pool_taken != payload_pool_tail &&
+            PTUPLE_ITEM(item, 1) == PLIST_ITEM(payload_pool, ring_slot(payload_pool_taken, payload_pool_count)))
+            payload_pool_taken = ring_advance(payload_pool_taken, 1, payload_pool_count);
+        PTUPLE_SET_ITEM(taken, i, item);
+        PLIST_SET_ITEM(activated_callbacks, slot, MAKE_NONE());
+    }
+    activated_callbacks_barrier(); // slots are cleared before the producer can reuse them
+    activated_callbacks_head = ring_advance(head, count, activated_callbacks_size);
+    MutexUnlock(&activated_callbacks_mutex);
+    dispatch_resume();
+    *res = taken;
+    return ERR_OK;
+}
+
+// buffers is a list of bytearrays of size bytes, or an empty list to go back to a new string per payload.
+// Must not be called while the loop runs
+C_NATIVE(_mqtt_set_payload_pool) {
+    NATIVE_UNWARN();
+
+    PObject *buffers;
+    int32_t size;
+    int i, count;
+
+    if (nargs != 2 || PTYPE(args[0]) != PLIST || !IS_PSMALLINT(args[1]))
+        return ERR_TYPE_EXC;
+    buffers = args[0];
+    size = PSMALLINT_VALUE(args[1]);
+    count = PSEQUENCE_ELEMENTS(buffers);
+    for (i = 0; i < count; i++) {
+        PObject *buffer = PLIST_ITEM(buffers, i);
+        if (PTYPE(buffer) != PBYTEARRAY || PSEQUENCE_ELEMENTS(buffer) < size)
+            return ERR_VALUE_EXC;
+    }
+
+    payload_pool = buffers;
+    payload_pool_size = size;
+    payload_pool_head = 0;
+    payload_pool_tail = 0;
+    payload_pool_taken = 0;
+    payload_pool_count = count;
     *res = MAKE_NONE();
     return ERR_OK;
 }
 
-C_NATIVE(_mqtt_activated_cbks_release) {
-    MutexUnlock(&activated_callbacks_mutex);
+// high is the queue length that pauses receiving, 0 never pauses: not with manual acks, that can't drop messages
+C_NATIVE(_mqtt_set_dispatch_water) {
+    NATIVE_UNWARN();
+
+    int32_t high;
+
+    if (parse_py_args("i", nargs, args, &high) != 1)
+        return ERR_TYPE_EXC;
+    if (high < 0 || high > activated_callbacks_size || (high == 0 && manual_ack))
+        return ERR_VALUE_EXC;
+
+    dispatch_pause_at = high;
+    dispatch_resume();
     *res = MAKE_NONE();
     return ERR_OK;
 }
 
+C_NATIVE(_mqtt_activated_cbks_stats) {
+    NATIVE_UNWARN();
+
+    PObject *stats[3];
+    stats[0] = PSMALLINT_NEW(activated_callbacks_used());
+    stats[1] = PSMALLINT_NEW(activated_callbacks_high_water);
+    stats[2] = PSMALLINT_NEW(activated_callbacks_dropped);
+    *res = ptuple_new(3, stats);
+    return ERR_OK;
+}
+
 C_NATIVE(_mqtt_topic_match) {
     NATIVE_UNWARN();
 
@@ -25,6 +25,15 @@ PORT = 1883
 BREAK_LOOP = 0
 RECOVERED = 1
 
+# stream events, for subscriptions with stream=True
+STREAM_BEGIN = 1            # a message starts, data is the total payload size
+STREAM_DATA = 2             # data is the next chunk of the payload
+STREAM_END = 3              # the message is complete, data is None
+
+# offline queue policies, see Client.set_offline_queue
+DROP_OLDEST = 0             # make room for new messages discarding the oldest queued ones
+DROP_NEWEST = 1             # discard new messages when the queue is full
+
 # connect return codes
 RC_ACCEPTED = 0             # Connection accepted
 RC_REFUSED_VERSION = 1      # Connection refused, unacceptable protocol version
@@ -55,7 +64,7 @@ RC_REFUSED_NOAUTH = 5       # Connection refused, not authorized
         "-I#csrc/zsockets"
     ]
 )
-def _mqtt_init(activated_cbks, client_id, clean_session, select_loop_time, command_timeout):
+def _mqtt_init(activated_cbks, client_id, clean_session, select_loop_time, command_timeout, inflight_window, stream_chunk, drain_packets):
     pass
 
 @native_c("_mqtt_connect", [])
@@ -75,15 +84,55 @@ def _mqtt_set_username_pw(username, password):
     pass
 
 @native_c("_mqtt_publish", [])
-def _mqtt_publish(topic, payload, qos, retain):
+def _mqtt_publish(topic, payload, qos, retain, wait):
+    pass
+
+@native_c("_mqtt_publish_handle", [])
+def _mqtt_publish_handle(topic, payload, qos, retain, wait):
+    pass
+
+@native_c("_mqtt_set_offline_queue", [])
+def _mqtt_set_offline_queue(budget, policy):
+    pass
+
+@native_c("_mqtt_offline_queue_stats", [])
+def _mqtt_offline_queue_stats():
+    pass
+
+@native_c("_mqtt_set_write_buffer", [])
+def _mqtt_set_write_buffer(size, delay):
+    pass
+
+@native_c("_mqtt_flush", [])
+def _mqtt_flush():
+    pass
+
+@native_c("_mqtt_set_manual_ack", [])
+def _mqtt_set_manual_ack(window):
+    pass
+
+@native_c("_mqtt_ack", [])
+def _mqtt_ack(packet_id):
+    pass
+
+@native_c("_mqtt_notify_published", [])
+def _mqtt_notify_published(enable):
+    pass
+
+@native_c("_mqtt_published", [])
+def _mqtt_published():
+    pass
+
+@native_c("_mqtt_published_stats", [])
+def _mqtt_published_stats():
     pass
 
 @native_c("_mqtt_subscribe", [])
-def _mqtt_subscribe(topic, qos):
+def _mqtt_subscribe(topics, qoss, sub_ids, conflate):
     pass
 
 @native_c("_mqtt_unsubscribe", [])
-def _mqtt_unsubscribe(topic):
+def _mqtt_unsubscribe(topics):
     pass
 
 @native_c("_mqtt_disconnect", [])
@@ -94,42 +143,85 @@ def _mqtt_disconnect():
 def _mqtt_cycle():
     pass
 
-@native_c("_mqtt_activated_cbks_acquire", [])
-def _mqtt_activated_cbks_acquire():
+@native_c("_mqtt_activated_cbks_take", [])
+def _mqtt_activated_cbks_take():
+    pass
+
+@native_c("_mqtt_set_payload_pool", [])
+def _mqtt_set_payload_pool(buffers, size):
+    pass
+
+@native_c("_mqtt_set_dispatch_water", [])
+def _mqtt_set_dispatch_water(high):
     pass
 
-@native_c("_mqtt_activated_cbks_release", [])
-def _mqtt_activated_cbks_release():
+@native_c("_mqtt_activated_cbks_stats", [])
+def _mqtt_activated_cbks_stats():
     pass
 
 @native_c("_mqtt_topic_match", [])
 def _mqtt_topic_match(topic,gen_topic):
     pass
 
+class TopicHandle:
+
+    def __init__(self, topic, qos):
+        """
+=================
+TopicHandle class
+=================
+
+.. class:: TopicHandle(topic, qos)
+
+    A topic prepared for many publishes, returned by :meth:`Client.topic_handle`.
+
+        """
+        self._topic = topic + '\0'  # zero terminated once, used in place by the native side
+        self.qos = qos
+
+    def publish(self, payload='', retain=False, wait=True):
+        """
+.. method:: publish(payload='', retain=False, wait=True)
+
+    Publishes a message on the topic of the handle, with its qos. Parameters and return value are the same as in :meth:`Client.publish`.
+        """
+        return _mqtt_publish_handle(self._topic, payload, self.qos, 1 if retain else 0, 1 if wait else 0)
+
 class Client:
 
-    def __init__(self, client_id, clean_session=True, cycle_timeout=500, command_timeout=60000):
+    def __init__(self, client_id, clean_session=True, cycle_timeout=0, command_timeout=60000, inflight_window=8, stream_chunk=1024, dispatch_depth=10, drain_packets=16):
         """
 ============
 Client class
 ============
 
-.. class:: Client(client_id, clean_session=True, cycle_timeout=500, command_timeout=60000)
+.. class:: Client(client_id, clean_session=True, cycle_timeout=0, command_timeout=60000, inflight_window=8, stream_chunk=1024, dispatch_depth=10, drain_packets=16)
 
     :param client_id: unique ID of the MQTT Client (multiple clients connecting to the same broken with the same ID are not allowed), can be an empty string with :samp:`clean_session` set to true.
     :param clean_session: when ``True`` requests the broker to assign a clean state to connecting client without remembering previous subscriptions or other configurations.
-    :param cycle_timeout: maximum time to wait for received messages on every loop cycle (in milliseconds)
+    :param cycle_timeout: maximum time the loop waits for received messages before waking up (in milliseconds). With ``0`` the loop sleeps until a packet comes in or a keepalive ping is due.
     :param command_timeout: maximum time to wait for protocol commands to be acknowledged (in milliseconds)
+    :param inflight_window: maximum number of QoS 1 and QoS 2 messages published with ``wait=False`` that can wait for their acknowledgement at the same time (at most 8).
+    :param stream_chunk: size of the payload pieces given to ``stream`` subscriptions for messages bigger than the 2048 bytes receive buffer.
+    :param dispatch_depth: number of received messages that can wait to be passed to their callbacks: when they are all waiting the client stops reading messages from the network (see :meth:`set_dispatch_water`).
+    :param drain_packets: maximum number of already received packets handled by a loop cycle before their callbacks are called (``1`` handles one packet at a time). A cycle also stops when ``dispatch_depth`` messages are waiting.
 
     Instantiates the MQTT Client.
 
         """
-        self._activated_cbks = [None]*10
-        self._cbks = {}
+        self._activated_cbks = [None]*dispatch_depth
+        self._cbks = {}             # subscription id -> (callback, stream, batch)
+        self._batches = {}          # subscription id -> (topic, payload) entries not given to its batch callback yet
+        self._payload_pool = []     # bytearrays received payloads are copied into, referenced here for the GC
+        self._sub_ids = {}          # topic -> subscription id
+        self._next_sub_id = 0
+        self._publish_cb = None
+        self._manual_ack = False    # if callbacks get packet ids to ack
+        self._stream_cbks = None    # stream callbacks of the message being streamed
         self._disconnected = True   # if disconnect() has been requested
         self._loop_started = False  # if loop() is running
 
-        _mqtt_init(self._activated_cbks, client_id, clean_session, cycle_timeout, command_timeout)
+        _mqtt_init(self._activated_cbks, client_id, clean_session, cycle_timeout, command_timeout, inflight_window, stream_chunk, drain_packets)
 
     def connect(self, host, keepalive, port=PORT, ssl_ctx=None, sock_keepalive=None, breconnect_cb=None, aconnect_cb=None, loop_failure=None, start_loop=True):
         """
@@ -250,6 +342,10 @@ Client class
 
     If ``breconnect_cb`` was passed to :meth:`connect`, ``breconnect_cb`` is executed first.
 
+    With ``clean_session`` set to ``False``, QoS 1 and QoS 2 messages published with ``wait=False`` and not yet acknowledged
+    are not lost with the connection: if the broker still has the session they are sent again, flagged as duplicates, and
+    complete as usual (see :meth:`set_publish_cb`), otherwise they complete as not acknowledged.
+
     Return the return code of the connection
         """
         if self._before_reconnect:
@@ -309,32 +405,235 @@ Client class
 
 
 
-    def publish(self, topic, payload='', qos=0, retain=False):
+    def publish(self, topic, payload='', qos=0, retain=False, wait=True):
         """
-.. method:: publish(topic, payload='', qos=0, retain=False)
+.. method:: publish(topic, payload='', qos=0, retain=False, wait=True)
 
     :param topic: topic the message should be published on.
-    :param payload: actual message to send. If not given a zero length message will be used.
+    :param payload: actual message to send. If not given a zero length message will be used. Payloads that do not fit in the 2048 bytes send buffer are sent directly from the given object, without being copied.
     :param qos: is the quality of service level to use.
     :param retain: if set to true, the message will be set as the "last known good"/retained message for the topic.
+    :param wait: if set to false, QoS 1 and QoS 2 messages do not wait for their acknowledgement.
 
     Publishes a message on a topic.
 
     This causes a message to be sent to the broker and subsequently from
     the broker to any clients subscribing to matching topics.
 
+    When ``wait`` is ``False`` up to ``inflight_window`` messages can be unacknowledged at the same time and
+    the call only blocks when the window is full. Completion is reported to the callback set with :meth:`set_publish_cb`,
+    also when the connection is lost while sending the message.
+
+    Returns the packet identifier assigned to the message (0 for QoS 0 messages), or -1 for a message whose topic does not fit
+    in the send buffer: it can't be sent and is discarded, the connection is kept.
+
+    While the client is disconnected messages are kept in the offline queue, if enabled with :meth:`set_offline_queue`:
+    the method returns 0 for queued messages and -1 for messages discarded by the queue policy.
+
     """
-        _mqtt_publish(topic, payload, qos, 1 if retain else 0)
+        return _mqtt_publish(topic, payload, qos, 1 if retain else 0, 1 if wait else 0)
+
+    def topic_handle(self, topic, qos=0):
+        """
+.. method:: topic_handle(topic, qos=0)
+
+    :param topic: topic the messages should be published on.
+    :param qos: quality of service level of the messages.
+
+    Returns a :class:`TopicHandle` to publish many messages on the same topic: the topic is prepared once,
+    instead of being copied and measured on every :meth:`publish`::
+
+        temp = mqtt_client.topic_handle("dev/42/temp", 1)
+        while True:
+            temp.publish(read_temperature())
+            sleep(1000)
+
+        """
+        return TopicHandle(topic, qos)
+
+    def set_offline_queue(self, budget, policy=DROP_OLDEST):
+        """
+.. method:: set_offline_queue(budget, policy=DROP_OLDEST)
+
+    :param budget: memory in bytes that messages published while disconnected can use, 0 disables the queue.
+    :param policy: what to do when the budget is exhausted: ``mqtt.DROP_OLDEST`` discards the oldest queued messages, ``mqtt.DROP_NEWEST`` the new ones.
 
-    def subscribe(self, topic, function, qos=0):
+    Enables the offline queue: messages published while the client is disconnected are copied and kept,
+    instead of raising an exception, and sent in order as soon as the client connects again (see :meth:`reconnect`),
+    before any message published later. Each queued message takes its topic and payload size plus a few bytes of bookkeeping.
+
+    Completion of queued QoS 1 and QoS 2 messages is reported to the callback set with :meth:`set_publish_cb`, with the packet identifier assigned when they are sent.
+
+        """
+        _mqtt_set_offline_queue(budget, policy)
+
+    def offline_queue_stats(self):
+        """
+.. method:: offline_queue_stats()
+
+    Returns a tuple ``(queued, used, dropped)`` describing the offline queue:
+    the number of messages waiting for a connection, the bytes of budget they use and the number of messages discarded by the queue policy so far.
+
+        """
+        return _mqtt_offline_queue_stats()
+
+    def set_write_buffer(self, size, delay=10):
         """
-.. method:: subscribe(topic, function, qos=0)
+.. method:: set_write_buffer(size, delay=10)
+
+    :param size: size in bytes of the buffer, 0 disables it. Bigger messages are sent directly.
+    :param delay: maximum time a message can wait in the buffer for others (in milliseconds), at least 1: smaller values raise ``ValueError``.
+
+    Gathers small outgoing messages (publishes and acknowledgements) to send them with a single write,
+    that over a secure socket is also a single TLS record, instead of one each.
+    Gathered messages are sent when the buffer is full, :samp:`delay` milliseconds after the first of them,
+    before waiting for any reply from the broker (e.g. :meth:`publish` with ``wait=True``) and on :meth:`flush`.
+
+    The delay is checked on every message sent and by the loop, that while the buffer is set waits for traffic
+    at most :samp:`delay` milliseconds at a time, so that messages published by other threads meanwhile are not held longer.
+
+        """
+        _mqtt_set_write_buffer(size, delay)
+
+    def flush(self):
+        """
+.. method:: flush()
+
+    Sends the messages gathered by the write buffer (see :meth:`set_write_buffer`).
+        """
+        _mqtt_flush()
+
+    def set_manual_ack(self, window):
+        """
+.. method:: set_manual_ack(window)
+
+    :param window: maximum number of received messages waiting for :meth:`ack` (at most 16), 0 acknowledges messages as soon as they are received.
+
+    Lets the application acknowledge QoS 1 and QoS 2 messages once it is done with them (e.g. after storing them), instead of as soon as they are received:
+    a message the application could not handle is sent again by the broker.
+    Callbacks get one more parameter, the packet identifier to pass to :meth:`ack` (``None`` for QoS 0 messages)::
+
+        def my_callback(mqtt_client, payload, topic, packet_id):
+            store(payload)
+            if packet_id is not None:
+                mqtt_client.ack(packet_id)
+
+    ``batch`` callbacks get ``(topic, payload, packet_id)`` tuples and ``stream`` callbacks get the packet identifier as data of ``mqtt.STREAM_END``.
+    A message matching several subscriptions must be acknowledged once, after all its callbacks.
+
+    When :samp:`window` messages wait for their acknowledgement the client stops reading messages from the network: the broker holds back the following ones.
+    Replies to the client's own requests and pings are still read, as long as they fit in the receive buffer behind the next message.
+    Messages received before a reconnection can't be acknowledged anymore: the broker sends them again, and they are given to the callbacks again.
+
+    Raises ``ValueError`` if :meth:`set_dispatch_water` was called with ``0``, as messages would be dropped when the queue is full.
+
+    Must be called before :meth:`connect`.
+        """
+        _mqtt_set_manual_ack(window)
+        self._manual_ack = window > 0
+
+    def ack(self, packet_id):
+        """
+.. method:: ack(packet_id)
+
+    :param packet_id: the packet identifier given to the callback.
+
+    Acknowledges a received message (see :meth:`set_manual_ack`).
+    Returns ``False`` if the message was not waiting for its acknowledgement, e.g. because it was already acknowledged or the connection was lost meanwhile.
+        """
+        return _mqtt_ack(packet_id)
+
+    def set_publish_cb(self, function):
+        """
+.. method:: set_publish_cb(function)
+
+    :param function: callback to be executed when a QoS 1 or QoS 2 publish completes, ``None`` to remove it.
+
+    The callback function is called by the MQTT read cycle passing three parameters: the MQTT client object, the packet identifier returned by :meth:`publish` and ``True`` if the message was acknowledged by the broker, ``False`` if the connection was lost before (or, without a clean session, if the broker did not resume the session on reconnection)::
+
+        def my_publish_callback(mqtt_client, packet_id, acked):
+            # do something with client, packet_id and acked
+            ...
+
+    A message whose exchange fails but that is queued again to be sent on the next connection is not reported as failed:
+    the callback is called once, when it completes under the packet identifier it is sent again with.
+
+        """
+        self._publish_cb = function
+        _mqtt_notify_published(0 if function is None else 1)
+
+    def publish_stats(self):
+        """
+.. method:: publish_stats()
+
+    Returns a tuple ``(pending, dropped)`` describing the completions waiting for the callback set by :meth:`set_publish_cb`:
+    the number of completions not passed to the callback yet and the number of completions discarded, oldest first, because the loop did not keep up with them.
+    The callback is not called for discarded completions.
+
+        """
+        return _mqtt_published_stats()
+
+    def dispatch_stats(self):
+        """
+.. method:: dispatch_stats()
+
+    Returns a tuple ``(pending, high_water, dropped)`` describing the queue of received messages waiting for their callbacks:
+    the number of messages currently queued, the maximum number ever queued at the same time and the number of messages dropped because the queue was full.
+    A ``high_water`` reaching ``dispatch_depth`` means callbacks are too slow for the incoming traffic.
+
+        """
+        return _mqtt_activated_cbks_stats()
+
+    def set_dispatch_water(self, high):
+        """
+.. method:: set_dispatch_water(high)
+
+    :param high: number of messages waiting for their callbacks that stops the reading of messages from the network, at most ``dispatch_depth``. 0 never stops it.
+
+    When callbacks are slower than the incoming traffic, the client leaves the following messages unread in the network buffers:
+    TCP flow control then slows down the broker, instead of the client dropping messages.
+    Replies to the messages published by the client that come behind an unread message wait as well.
+    By default reading stops when ``dispatch_depth`` messages are waiting, and resumes once the loop has called their callbacks.
+    With :samp:`high` set to 0, messages received while the queue is full are dropped and counted by :meth:`dispatch_stats`:
+    this is not allowed with :meth:`set_manual_ack`, that can't drop messages, and raises ``ValueError``.
+
+    A broker that can't send for a long time may close the connection: callbacks should not block for longer than the keepalive time.
+        """
+        _mqtt_set_dispatch_water(high)
+
+    def set_payload_pool(self, count, size):
+        """
+.. method:: set_payload_pool(count, size)
+
+    :param count: number of buffers in the pool, 0 disables the pool.
+    :param size: size of each buffer in bytes: bigger payloads are not pooled.
+
+    Received payloads of at most :samp:`size` bytes are copied into one of :samp:`count` preallocated bytearrays instead of a new string,
+    so that a steady flow of messages doesn't allocate on the heap for every payload.
+    A buffer is reused as soon as the callback it was given to returns: callbacks must copy the payload to keep it.
+    When all the buffers are in use, payloads are passed as strings as usual.
+
+    Must be called before :meth:`connect`.
+        """
+        pool = []
+        for i in range(count):
+            pool.append(bytearray(size))
+        _mqtt_set_payload_pool(pool, size)
+        self._payload_pool = pool
+
+    def subscribe(self, topic, function, qos=0, stream=False, batch=0, conflate=False):
+        """
+.. method:: subscribe(topic, function, qos=0, stream=False, batch=0, conflate=False)
 
     :param topic: topic to subscribe to.
     :param function: callback to be executed when a message published on chosen topic is received.
     :param qos: quality of service for the subscription.
+    :param stream: if ``True`` messages are given to the callback in pieces, so that payloads bigger than the receive buffer can be received.
+    :param batch: if not zero, messages are given to the callback in lists of at most :samp:`batch` entries (see below). Can't be used with ``stream``.
+    :param conflate: if ``True`` only the latest message received on a topic is given to the callback (see below). Can't be used with ``stream``.
 
     Subscribes to a topic and set a callback for processing messages published on it.
+    Messages received with QoS 2 are passed to the callback once, even when the broker sends them again before completing their delivery.
 
     The callback function is called passing three parameters: the MQTT client object, the payload of received message and the actual topic::
 
@@ -342,9 +641,71 @@ Client class
             # do something with client, payload and topic
             ...
 
+    Messages bigger than the receive buffer are only delivered to ``stream`` subscriptions. Their callback is called passing four parameters: the MQTT client object, the event, its data and the actual topic.
+    Every message produces a ``mqtt.STREAM_BEGIN`` event with the total payload size, one or more ``mqtt.STREAM_DATA`` events with the pieces of the payload (``stream_chunk`` bytes each) and a ``mqtt.STREAM_END`` event::
+
+        def my_stream_callback(mqtt_client, event, data, topic):
+            if event == mqtt.STREAM_BEGIN:
+                # data is the total payload size
+                ...
+            elif event == mqtt.STREAM_DATA:
+                # data is the next piece of the payload
+                ...
+            else:
+                # the message is complete
+                ...
+
+    With ``batch`` the callback is called passing two parameters: the MQTT client object and a list of ``(topic, payload)`` tuples.
+    The list holds the messages received by a loop cycle (see ``drain_packets``), and is passed as soon as it reaches :samp:`batch` entries.
+    High rate topics are handled with one call for many messages::
+
+        def my_batch_callback(mqtt_client, messages):
+            for topic, payload in messages:
+                ...
+
+    With ``conflate`` a message still waiting for the callback is replaced by the next message received on the same topic, keeping its place in the queue:
+    when the callback is slower than the incoming traffic it skips stale values instead of falling behind, and the queue doesn't grow.
+    Useful when only the latest value of a topic matters (e.g. sensor readings). Messages that also match a subscription without ``conflate`` are not replaced. With :meth:`set_manual_ack` only QoS 0 messages are replaced: the others must each be acknowledged by the application.
+
+        """
+        self.subscribe_many([(topic, function, qos)], stream, batch, conflate)
+
+    def subscribe_many(self, subscriptions, stream=False, batch=0, conflate=False):
+        """
+.. method:: subscribe_many(subscriptions, stream=False, batch=0, conflate=False)
+
+    :param subscriptions: list of ``(topic, function, qos)`` tuples.
+    :param stream: if ``True`` messages are given to the callbacks in pieces, as in :meth:`subscribe`.
+    :param batch: if not zero, messages are given to the callbacks in lists, as in :meth:`subscribe`.
+    :param conflate: if ``True`` only the latest message received on each topic is given to the callbacks, as in :meth:`subscribe`.
+
+    Subscribes to several topics with a single subscribe message, waiting for the broker reply once for all of them.
+    Callbacks are the same as in :meth:`subscribe`.
+
+    Returns the list of qos granted by the broker, in the same order as ``subscriptions``.
+    A granted qos of ``0x80`` means the broker refused that subscription: no callback is set for its topic.
         """
-        _mqtt_subscribe(topic, qos)
-        self._cbks[topic] = function
+        if stream and (batch or conflate):
+            raise ValueError
+        # the native side reports which subscriptions match a message by id
+        topics = []
+        qoss = []
+        sub_ids = []
+        for topic, function, qos in subscriptions:
+            sub_id = self._sub_ids.get(topic)
+            if sub_id is None:
+                sub_id = self._next_sub_id
+                self._next_sub_id += 1
+            topics.append(topic)
+            qoss.append(qos)
+            sub_ids.append(sub_id)
+        granted = _mqtt_subscribe(topics, qoss, sub_ids, 1 if conflate else 0)
+        for i in range(len(topics)):
+            if granted[i] == 0x80:
+                continue
+            self._sub_ids[topics[i]] = sub_ids[i]
+            self._cbks[sub_ids[i]] = (subscriptions[i][1], stream, batch)
+        return list(granted)
 
     def unsubscribe(self, topic):
         """
@@ -354,14 +715,29 @@ Client class
 
     :param topic: is the string representing the subscribed topic to unsubscribe from.
         """
-        _mqtt_unsubscribe(topic)
-        self._cbks[topic] = None
+        self.unsubscribe_many([topic])
+
+    def unsubscribe_many(self, topics):
+        """
+.. method:: unsubscribe_many(topics)
+
+    Unsubscribes the client from several topics with a single unsubscribe message.
+
+    :param topics: list of the subscribed topics to unsubscribe from.
+        """
+        _mqtt_unsubscribe(topics)
+        for topic in topics:
+            sub_id = self._sub_ids.pop(topic, None)
+            if sub_id is not None:
+                self._cbks.pop(sub_id, None)
+                self._batches.pop(sub_id, None)
 
     def disconnect(self,timeout=None):
         """
 .. method:: disconnect(timeout=None)
 
     Sends a disconnect message, optionally waiting for the loop to exit.
+    The loop wakes up when the broker closes the connection, or when the socket is closed at the end of :samp:`timeout`.
 
     :param timeout: is the maximum time to wait (in milliseconds).
         """
@@ -391,6 +767,63 @@ Client class
         except:
             pass
 
+    def _stream(self, topic, data, sub_ids, event):
+        # topic and subscriptions are only given with STREAM_BEGIN, remember who gets the following events
+        if event == STREAM_BEGIN:
+            self._stream_cbks = []
+            for sub_id in sub_ids:
+                cb = self._cbks.get(sub_id)
+                if cb and cb[1]:
+                    self._stream_cbks.append(cb[0])
+            self._stream_topic = topic
+        if self._stream_cbks:
+            for cb in self._stream_cbks:
+                cb(self,event,data,self._stream_topic)
+        elif event == STREAM_END and data is not None:
+            _mqtt_ack(data) # with manual acks, nobody else would ack it
+        if event == STREAM_END:
+            self._stream_cbks = None
+
+    def _batch(self, sub_id, cb, topic, payload, packet_id):
+        entries = self._batches.get(sub_id)
+        if entries is None:
+            entries = []
+            self._batches[sub_id] = entries
+        entries.append((topic, payload, packet_id) if self._manual_ack else (topic, payload))
+        if len(entries) >= cb[2]:
+            del self._batches[sub_id]
+            cb[0](self,entries)
+
+    def _dispatch(self, activated_topic_payload):
+        topic = activated_topic_payload[0]
+        # print("received",topic)
+        if len(activated_topic_payload) == 4:
+            self._stream(topic, activated_topic_payload[1], activated_topic_payload[2], activated_topic_payload[3])
+            return
+        # with manual acks, QoS 1 and QoS 2 messages come with their packet id
+        packet_id = None
+        if len(activated_topic_payload) == 5 and activated_topic_payload[4]:
+            packet_id = activated_topic_payload[3]
+        handled = False
+        for sub_id in activated_topic_payload[2]:
+            cb = self._cbks.get(sub_id)
+            if cb:
+                handled = True
+                # print(activated_topic_payload[1])
+                if cb[1]:
+                    payload = activated_topic_payload[1]
+                    cb[0](self,STREAM_BEGIN,len(payload),topic)
+                    cb[0](self,STREAM_DATA,payload,topic)
+                    cb[0](self,STREAM_END,packet_id,topic)
+                elif cb[2]:
+                    self._batch(sub_id, cb, topic, activated_topic_payload[1], packet_id)
+                elif self._manual_ack:
+                    cb[0](self,activated_topic_payload[1],topic,packet_id)
+                else:
+                    cb[0](self,activated_topic_payload[1],topic)
+        if packet_id is not None and not handled:
+            _mqtt_ack(packet_id) # unsubscribed meanwhile: nobody else would ack it
+
     def _loop(self):
         while self._loop_started:
             try:
@@ -408,25 +841,39 @@ Client class
                     break
                 # print("lwmqtt loop recovered")
 
-            _mqtt_activated_cbks_acquire()
-            for i, activated_topic_payload in enumerate(self._activated_cbks):
-                if not activated_topic_payload:
-                    break
-                try:
-                    topic = activated_topic_payload[0]
-                    # print("received",topic)
-                    for tpx, cb in self._cbks.items():
-                        # print("comparing to",tpx,_mqtt_topic_match(topic,tpx))
-                        if _mqtt_topic_match(topic,tpx):
-                            # print(activated_topic_payload[1])
-                            cb(self,activated_topic_payload[1],topic)
-                except Exception as e:
-                    # print(e)
-                    _mqtt_activated_cbks_release()
-                    # release and raise
-                    raise e
-                self._activated_cbks[i] = None
-            _mqtt_activated_cbks_release()
+            activated = _mqtt_activated_cbks_take()
+            if activated:
+                # the messages are off the native queue: a callback raising must not lose the ones after it
+                error = None
+                for activated_topic_payload in activated:
+                    try:
+                        self._dispatch(activated_topic_payload)
+                    except Exception as e:
+                        if error is None:
+                            error = e
+                # what the cycle received is complete: partial batches go to their callbacks too
+                if self._batches:
+                    batches = self._batches
+                    self._batches = {}
+                    for sub_id in batches:
+                        cb = self._cbks.get(sub_id)
+                        if cb:
+                            try:
+                                cb[0](self,batches[sub_id])
+                            except Exception as e:
+                                if error is None:
+                                    error = e
+                if error is not None:
+                    raise error
+
+            if self._publish_cb:
+                published = _mqtt_published()
+                if published:
+                    for packet_id in published:
+                        if packet_id > 0:
+                            self._publish_cb(self, packet_id, True)
+                        else:
+                            self._publish_cb(self, -packet_id, False)
         self._loop_started = False
 
 ## Some topic match tests